@@ -0,0 +1,118 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "../fs/include/fs.h"
+
+/*
+ * Directory walk benchmark.
+ *
+ * Builds a tree of ndirs directories holding nfiles files each, writing
+ * the files round-robin over the directories the way an untar or a
+ * parallel build interleaves them, then walks the tree from a cold page
+ * cache: list every directory, open and read every file.
+ *
+ * usage: dirwalk image [ndirs] [nfiles] [file size]
+ */
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* evict the image from the page cache so the walk hits the disk */
+static void drop_cache(const char * image) {
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static long walk(fs * f, int ndirs, char * buf, int fsize) {
+    char path[256], name[128];
+    long bytes = 0;
+    int d;
+
+    for (d = 0; d < ndirs; ++d) {
+        fs_dir * dir;
+        sprintf(path, "/d%d", d);
+        dir = fs_opendir(f, path);
+        if (dir == NULL) continue;
+        while (fs_nextent(dir, name, sizeof(name))) {
+            char fpath[256 + 128];
+            int fd, n;
+            if (name[0] == '.') continue;
+            sprintf(fpath, "%s/%s", path, name);
+            if ((fd = fs_open(f, fpath, FS_READ)) < 0) continue;
+            if ((n = fs_read(f, fd, buf, fsize)) > 0) bytes += n;
+            fs_close(f, fd);
+        }
+        fs_closedir(dir);
+    }
+    return bytes;
+}
+
+int main(int argc, char ** argv) {
+    int ndirs = argc > 2 ? atoi(argv[2]) : 64;
+    int nfiles = argc > 3 ? atoi(argv[3]) : 64;
+    int fsize = argc > 4 ? atoi(argv[4]) : 16384;
+    fs_opts opts = { 1 << 20, 0, FS_BK_PIO };
+    char path[256];
+    char * buf;
+    long nblk, bytes;
+    double t0, t1, t2;
+    fs * f;
+    int d, i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s image [ndirs] [nfiles] [file size]\n", argv[0]);
+        return 1;
+    }
+    buf = malloc(fsize);
+    if (buf == NULL) return 1;
+    memset(buf, 'x', fsize);
+
+    nblk = (long) ndirs * nfiles * (fsize / 4096 + 2) + ndirs * 4 + 1024;
+    f = fs_creatfs_opt(argv[1], nblk, ndirs * (nfiles + 2) + 64, &opts);
+    if (f == NULL) {
+        fprintf(stderr, "cannot create %s\n", argv[1]);
+        return 1;
+    }
+    t0 = now();
+    for (d = 0; d < ndirs; ++d) {
+        sprintf(path, "/d%d", d);
+        fs_mkdir(f, path);
+    }
+    for (i = 0; i < nfiles; ++i)
+        for (d = 0; d < ndirs; ++d) {
+            int fd;
+            sprintf(path, "/d%d/f%d", d, i);
+            if ((fd = fs_open(f, path, FS_WRITE)) < 0) {
+                fprintf(stderr, "cannot create %s\n", path);
+                return 1;
+            }
+            fs_write(f, fd, buf, fsize);
+            fs_close(f, fd);
+        }
+    fs_closefs(f);
+    t1 = now();
+
+    drop_cache(argv[1]);
+    f = fs_openfs_opt(argv[1], &opts);
+    if (f == NULL) return 1;
+    t2 = now();
+    bytes = walk(f, ndirs, buf, fsize);
+    t2 = now() - t2;
+    fs_closefs(f);
+
+    printf("%d dirs x %d files x %d bytes\n", ndirs, nfiles, fsize);
+    printf("build     %.3f s\n", t1 - t0);
+    printf("cold walk %.3f s, %.1f MB/s\n", t2, bytes / t2 / (1 << 20));
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,314 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "../fs/include/fs.h"
+
+/*
+ * Micro-benchmarks of the fs library.
+ *
+ *   format, mount       fs_creatfs and fs_openfs of an image, each
+ *                       followed by fs_closefs
+ *   seq_write, seq_read a file of -m MB in -c byte pieces; reads start
+ *                       from a freshly mounted image
+ *   rand_write,         -c byte pieces at random aligned offsets of the
+ *   rand_read           same file
+ *   create, stat,       -n small files in one directory
+ *   unlink
+ *   lookup_wN_dD        opening a file at depth D in directories of N
+ *                       entries, for every N in -w and D in -d
+ *
+ * Each operation is timed and the results are printed as one JSON
+ * object with latency percentiles in microseconds, and a rate.
+ *
+ * usage: fs_bench [-f image] [-b backend] [-m MB] [-c chunk] [-n files]
+ *                 [-w widths] [-d depths] [-r rounds]
+ */
+
+typedef struct samples_ {
+    double * v;
+    long n;
+    long cap;
+} samples;
+
+static const char * image = "/tmp/fs_bench.img";
+static fs_opts opts;
+static int first_result = 1;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add(samples * s, double t) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(double));
+        if (s->v == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = t;
+}
+
+static int cmp_double(const void * a, const void * b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct(const samples * s, double p) {
+    long i = (long) (p / 100 * (s->n - 1) + 0.5);
+    return s->v[i] * 1e6;
+}
+
+/*
+ * Print one result: the latency distribution of s and, for bytes > 0,
+ * the throughput over total seconds.
+ */
+static void report(const char * name, samples * s, double total, long bytes) {
+    if (s->n == 0) return;
+    qsort(s->v, s->n, sizeof(double), cmp_double);
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %ld, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f,", first_result ? "" : ",", name, s->n,
+           total, s->n / total);
+    if (bytes > 0)
+        printf(" \"mb_per_sec\": %.1f,", bytes / total / (1 << 20));
+    printf("\n     \"lat_us\": {\"min\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+           "\"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}",
+           pct(s, 0), pct(s, 50), pct(s, 90), pct(s, 99), pct(s, 99.9),
+           pct(s, 100));
+    first_result = 0;
+    s->n = 0;
+}
+
+static fs * mount(void) {
+    fs * f = fs_openfs_opt(image, &opts);
+    if (f == NULL) {
+        fprintf(stderr, "cannot open %s\n", image);
+        exit(1);
+    }
+    return f;
+}
+
+static fs * format(long nblk, int ninode) {
+    fs * f = fs_creatfs_opt(opts.backend == FS_BK_MEM ? NULL : image,
+                            nblk, ninode, &opts);
+    if (f == NULL) {
+        fprintf(stderr, "cannot create %s\n", image);
+        exit(1);
+    }
+    return f;
+}
+
+static void bench_format(samples * s, long nblk, int rounds) {
+    double t, t0 = now();
+    int i;
+    for (i = 0; i < rounds; ++i) {
+        t = now();
+        fs_closefs(format(nblk, -1));
+        add(s, now() - t);
+    }
+    report("format", s, now() - t0, 0);
+    if (opts.backend == FS_BK_MEM) return;
+    t0 = now();
+    for (i = 0; i < rounds; ++i) {
+        t = now();
+        fs_closefs(mount());
+        add(s, now() - t);
+    }
+    report("mount", s, now() - t0, 0);
+}
+
+static void bench_io(samples * s, long size, int chunk) {
+    char * buf = malloc(chunk);
+    long n = size / chunk, i;
+    double t, t0;
+    fs * f = format(size / 4096 * 2 + 4096, 1024);
+    int fd;
+
+    memset(buf, 'x', chunk);
+    fd = fs_open(f, "/seq", FS_READ | FS_WRITE);
+    t0 = now();
+    for (i = 0; i < n; ++i) {
+        t = now();
+        fs_write(f, fd, buf, chunk);
+        add(s, now() - t);
+    }
+    fs_sync(f);
+    report("seq_write", s, now() - t0, n * chunk);
+
+    /* a new mount reads through an empty block cache */
+    if (opts.backend != FS_BK_MEM) {
+        fs_closefs(f);
+        f = mount();
+        fd = fs_open(f, "/seq", FS_READ);
+    }
+    fs_seek(f, fd, 0, FS_SET);
+    t0 = now();
+    for (i = 0; i < n; ++i) {
+        t = now();
+        fs_read(f, fd, buf, chunk);
+        add(s, now() - t);
+    }
+    report("seq_read", s, now() - t0, n * chunk);
+
+    fs_close(f, fd);
+    fd = fs_open(f, "/seq", FS_READ | FS_WRITE | FS_APPEND);
+    srand(1);
+    t0 = now();
+    for (i = 0; i < n; ++i) {
+        unsigned int off = (unsigned int) (rand() % n) * chunk;
+        t = now();
+        fs_pwrite(f, fd, buf, chunk, off);
+        add(s, now() - t);
+    }
+    fs_sync(f);
+    report("rand_write", s, now() - t0, n * chunk);
+
+    t0 = now();
+    for (i = 0; i < n; ++i) {
+        unsigned int off = (unsigned int) (rand() % n) * chunk;
+        t = now();
+        fs_pread(f, fd, buf, chunk, off);
+        add(s, now() - t);
+    }
+    report("rand_read", s, now() - t0, n * chunk);
+    fs_close(f, fd);
+    fs_closefs(f);
+    free(buf);
+}
+
+static void bench_small(samples * s, int nfiles) {
+    fs * f = format((long) nfiles * 2 + 8192, nfiles + 1024);
+    char path[64], buf[512];
+    inode st;
+    double t, t0;
+    int i, fd;
+
+    memset(buf, 'y', sizeof(buf));
+    fs_mkdir(f, "/small");
+    t0 = now();
+    for (i = 0; i < nfiles; ++i) {
+        sprintf(path, "/small/f%d", i);
+        t = now();
+        fd = fs_open(f, path, FS_WRITE);
+        fs_write(f, fd, buf, sizeof(buf));
+        fs_close(f, fd);
+        add(s, now() - t);
+    }
+    report("create", s, now() - t0, 0);
+
+    t0 = now();
+    for (i = 0; i < nfiles; ++i) {
+        sprintf(path, "/small/f%d", (int) ((i * 7919L) % nfiles));
+        t = now();
+        fd = fs_open(f, path, FS_READ);
+        fs_fstat(f, fd, &st);
+        fs_close(f, fd);
+        add(s, now() - t);
+    }
+    report("stat", s, now() - t0, 0);
+
+    t0 = now();
+    for (i = 0; i < nfiles; ++i) {
+        sprintf(path, "/small/f%d", i);
+        t = now();
+        fs_remove(f, path);
+        add(s, now() - t);
+    }
+    report("unlink", s, now() - t0, 0);
+    fs_closefs(f);
+}
+
+/*
+ * Path lookup: a chain of depth directories, each holding width
+ * entries, with the file looked up at the bottom.
+ */
+static void bench_lookup(samples * s, int width, int depth, int rounds) {
+    fs * f = format((long) width * depth * 2 + 8192, width * depth + 1024);
+    char path[4096], name[64];
+    int len = 0, d, i, fd;
+    double t, t0;
+
+    for (d = 0; d < depth; ++d) {
+        for (i = 0; i < width - 1; ++i) {
+            sprintf(path + len, "/e%d", i);
+            fd = fs_open(f, path, FS_WRITE);
+            fs_close(f, fd);
+        }
+        len += sprintf(path + len, "/d%d", d);
+        fs_mkdir(f, path);
+    }
+    strcpy(path + len, "/target");
+    fd = fs_open(f, path, FS_WRITE);
+    fs_close(f, fd);
+
+    t0 = now();
+    for (i = 0; i < rounds; ++i) {
+        t = now();
+        fd = fs_open(f, path, FS_READ);
+        fs_close(f, fd);
+        add(s, now() - t);
+    }
+    sprintf(name, "lookup_w%d_d%d", width, depth);
+    report(name, s, now() - t0, 0);
+    fs_closefs(f);
+}
+
+/* parse a comma separated list of up to max numbers into v */
+static int parse_list(const char * s, int * v, int max) {
+    int n = 0;
+    while (*s && n < max) {
+        v[n++] = atoi(s);
+        while (*s && *s != ',') ++s;
+        if (*s == ',') ++s;
+    }
+    return n;
+}
+
+int main(int argc, char ** argv) {
+    int widths[16] = { 16, 256, 4096 }, nw = 3;
+    int depths[16] = { 1, 4, 16 }, nd = 3;
+    long mb = 64;
+    int chunk = 4096, nfiles = 10000, rounds = 20;
+    samples s = { NULL, 0, 0 };
+    int c, i, j;
+
+    opts.backend = FS_BK_PIO;
+    while ((c = getopt(argc, argv, "f:b:m:c:n:w:d:r:")) != -1) {
+        switch (c) {
+        case 'f': image = optarg; break;
+        case 'b': opts.backend = atoi(optarg); break;
+        case 'm': mb = atol(optarg); break;
+        case 'c': chunk = atoi(optarg); break;
+        case 'n': nfiles = atoi(optarg); break;
+        case 'w': nw = parse_list(optarg, widths, 16); break;
+        case 'd': nd = parse_list(optarg, depths, 16); break;
+        case 'r': rounds = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-f image] [-b backend] [-m MB] [-c chunk] "
+                    "[-n files] [-w widths] [-d depths] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (chunk <= 0 || mb <= 0 || nfiles <= 0 || rounds <= 0) return 1;
+
+    printf("{\"bench\": \"fs_bench\", \"backend\": %d, \"file_mb\": %ld, "
+           "\"chunk\": %d, \"files\": %d,\n \"results\": [", opts.backend, mb,
+           chunk, nfiles);
+    bench_format(&s, (mb << 20) / 4096 * 4, rounds);
+    bench_io(&s, mb << 20, chunk);
+    bench_small(&s, nfiles);
+    for (i = 0; i < nw; ++i)
+        for (j = 0; j < nd; ++j)
+            bench_lookup(&s, widths[i], depths[j], rounds * 100);
+    printf("\n]}\n");
+    if (opts.backend != FS_BK_MEM) unlink(image);
+    free(s.v);
+    return 0;
+}
@@ -0,0 +1,302 @@
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../fs/include/fs.h"
+
+/*
+ * Play back a log written by fs_record_start() against an image, to
+ * compare a change of the library on a recorded workload.
+ *
+ * Calls are repeated one at a time in the order they were logged, which
+ * is the order they finished in, so a replay of the same log against
+ * the same image always does the same thing. Descriptors and
+ * directories are mapped from the recorded to the new ones; calls on
+ * one opened before recording started are skipped. Written data is a
+ * fixed pattern. fs_wait() is not repeated; the reads and writes of
+ * asynchronous requests are logged as the fs_pread()/fs_pwrite() calls
+ * that carried them out.
+ *
+ * With -t every call waits until as long after the start of the replay
+ * as it was made after the start of recording; otherwise they run back
+ * to back. The image is changed in place, so give it a copy of a
+ * snapshot, or -n blocks to format a fresh one first.
+ *
+ * The result is one JSON object: totals, then per call the number made,
+ * bytes moved and latency percentiles in microseconds, of the replay
+ * and as recorded. "diverged" counts calls whose result differed from
+ * the recorded one.
+ *
+ * usage: fs_replay [-t] [-b backend] [-c cache MB] [-n blocks [-i inodes]]
+ *                  log image
+ */
+
+typedef struct samples_ {
+    double * v;
+    long n;
+    long cap;
+} samples;
+
+typedef struct opstat_ {
+    samples lat;
+    samples rec;
+    long bytes;
+} opstat;
+
+static const char * opname[FS_NOPS] = {
+    "fs_sync", "fs_fsync", "fs_chdir", "fs_open", "fs_close", "fs_read",
+    "fs_write", "fs_readv", "fs_writev", "fs_pread", "fs_pwrite", "fs_seek",
+    "fs_fstat", "fs_remove", "fs_mkdir", "fs_removedir", "fs_opendir",
+    "fs_nextent", "fs_closedir", "fs_wait"
+};
+
+#define MAX_IO (256 << 20)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add(samples * s, double t) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->v = realloc(s->v, s->cap * sizeof(double));
+        if (s->v == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = t;
+}
+
+static int cmp_double(const void * a, const void * b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct(const samples * s, double p) {
+    long i = (long) (p / 100 * (s->n - 1) + 0.5);
+    return s->v[i] * 1e6;
+}
+
+static void print_lat(const char * key, samples * s) {
+    qsort(s->v, s->n, sizeof(double), cmp_double);
+    printf("\"%s\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}",
+           key, pct(s, 50), pct(s, 90), pct(s, 99), pct(s, 100));
+}
+
+/* grow v, of *n entries initialized to fill, to hold index i */
+static void * grow(void * v, int * n, int i, size_t size, int fill) {
+    int m = *n;
+    if (i < m) return v;
+    while (m <= i)
+        m = m ? m * 2 : 256;
+    v = realloc(v, m * size);
+    if (v == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset((char*) v + *n * size, fill, (m - *n) * size);
+    *n = m;
+    return v;
+}
+
+int main(int argc, char ** argv) {
+    fs_opts opts;
+    fs * f;
+    FILE * log;
+    fs_rec r;
+    char path[65536];
+    opstat st[FS_NOPS];
+    int * fdmap = NULL, nfd = 0;        /* recorded fd -> fd, -1 unknown */
+    fs_dir ** dirs = NULL;
+    int ndirs = 0;
+    char * buf = NULL;
+    long bufsz = 0, nops = 0, bytes = 0, diverged = 0, skipped = 0;
+    long nblk = 0;
+    int ninode = -1, timed = 0, magic, c, i;
+    double t0, t, lat;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.backend = FS_BK_PIO;
+    while ((c = getopt(argc, argv, "tb:c:n:i:")) != -1) {
+        switch (c) {
+        case 't': timed = 1; break;
+        case 'b': opts.backend = atoi(optarg); break;
+        case 'c': opts.cache_size = (size_t) atol(optarg) << 20; break;
+        case 'n': nblk = atol(optarg); break;
+        case 'i': ninode = atoi(optarg); break;
+        default:
+            optind = argc;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-t] [-b backend] [-c cache MB] "
+                "[-n blocks [-i inodes]] log image\n", argv[0]);
+        return 1;
+    }
+    log = fopen(argv[optind], "rb");
+    if (log == NULL || fread(&magic, sizeof(magic), 1, log) != 1 ||
+        magic != FS_REC_MAGIC) {
+        fprintf(stderr, "%s is not a recorded log\n", argv[optind]);
+        return 1;
+    }
+    f = nblk > 0 ? fs_creatfs_opt(argv[optind + 1], nblk, ninode, &opts)
+                 : fs_openfs_opt(argv[optind + 1], &opts);
+    if (f == NULL) {
+        fprintf(stderr, "cannot open %s\n", argv[optind + 1]);
+        return 1;
+    }
+    memset(st, 0, sizeof(st));
+
+    t0 = now();
+    while (fread(&r, sizeof(r), 1, log) == 1) {
+        int fd = -1, ret = 0, same = 1, moved = 0;
+        fs_dir * d = NULL;
+
+        if (r.path_len && fread(path, 1, r.path_len, log) != r.path_len) break;
+        path[r.path_len] = '\0';
+        if (r.op < 0 || r.op >= FS_NOPS || r.op == FS_OP_WAIT) continue;
+        if (r.fd >= 0) {
+            fdmap = grow(fdmap, &nfd, r.fd, sizeof(int), 0xff);
+            dirs = grow(dirs, &ndirs, r.fd, sizeof(fs_dir*), 0);
+            fd = fdmap[r.fd];
+            d = dirs[r.fd];
+        }
+        if (r.arg > bufsz && r.arg <= MAX_IO) {
+            buf = realloc(buf, r.arg);
+            if (buf == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+            memset(buf, 'r', r.arg);
+            bufsz = r.arg;
+        }
+        switch (r.op) {
+        case FS_OP_OPENDIR:
+        case FS_OP_NEXTENT:
+        case FS_OP_CLOSEDIR:
+            if (r.op != FS_OP_OPENDIR && d == NULL) {
+                ++skipped;
+                continue;
+            }
+            break;
+        case FS_OP_FSYNC: case FS_OP_CLOSE: case FS_OP_READ: case FS_OP_WRITE:
+        case FS_OP_READV: case FS_OP_WRITEV: case FS_OP_PREAD:
+        case FS_OP_PWRITE: case FS_OP_SEEK: case FS_OP_FSTAT:
+            if (fd == -1 || r.arg > MAX_IO) {
+                ++skipped;
+                continue;
+            }
+        }
+
+        if (timed) {
+            double wait = t0 + r.start / 1e9 - now();
+            if (wait > 0) {
+                struct timespec ts;
+                ts.tv_sec = (time_t) wait;
+                ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        t = now();
+        switch (r.op) {
+        case FS_OP_SYNC: ret = fs_sync(f); break;
+        case FS_OP_FSYNC: ret = fs_fsync(f, fd); break;
+        case FS_OP_CHDIR: ret = fs_chdir(f, path); break;
+        case FS_OP_OPEN:
+            ret = fs_open(f, path, (int) r.arg);
+            same = (ret >= 0) == (r.ret >= 0);
+            if (r.ret >= 0) {
+                fdmap = grow(fdmap, &nfd, r.ret, sizeof(int), 0xff);
+                fdmap[r.ret] = ret;
+            }
+            break;
+        case FS_OP_CLOSE:
+            fs_close(f, fd);
+            fdmap[r.fd] = -1;
+            break;
+        case FS_OP_READ: ret = moved = fs_read(f, fd, buf, r.arg); break;
+        case FS_OP_WRITE: ret = moved = fs_write(f, fd, buf, r.arg); break;
+        case FS_OP_READV:
+        case FS_OP_WRITEV: {
+            fs_iovec v;
+            v.base = buf;
+            v.len = r.arg;
+            ret = moved = r.op == FS_OP_READV ? fs_readv(f, fd, &v, 1)
+                                              : fs_writev(f, fd, &v, 1);
+            break;
+        }
+        case FS_OP_PREAD: ret = moved = fs_pread(f, fd, buf, r.arg, r.off); break;
+        case FS_OP_PWRITE: ret = moved = fs_pwrite(f, fd, buf, r.arg, r.off); break;
+        case FS_OP_SEEK: ret = fs_seek(f, fd, (int) r.arg, r.off); break;
+        case FS_OP_FSTAT: {
+            inode in;
+            ret = fs_fstat(f, fd, &in);
+            break;
+        }
+        case FS_OP_REMOVE: ret = fs_remove(f, path); break;
+        case FS_OP_MKDIR: ret = fs_mkdir(f, path); break;
+        case FS_OP_REMOVEDIR: ret = fs_removedir(f, path); break;
+        case FS_OP_OPENDIR:
+            d = fs_opendir(f, path);
+            ret = d != NULL ? r.ret : -1;
+            if (r.ret >= 0) {
+                dirs = grow(dirs, &ndirs, r.ret, sizeof(fs_dir*), 0);
+                if (dirs[r.ret] != NULL) fs_closedir(dirs[r.ret]);
+                dirs[r.ret] = d;
+            }
+            else if (d != NULL)
+                fs_closedir(d);
+            break;
+        case FS_OP_NEXTENT: ret = fs_nextent(d, path, sizeof(path)); break;
+        case FS_OP_CLOSEDIR:
+            fs_closedir(d);
+            dirs[r.fd] = NULL;
+            break;
+        }
+        lat = now() - t;
+
+        if (same && ret != r.ret && r.op != FS_OP_OPEN)
+            same = 0;
+        diverged += !same;
+        ++nops;
+        if (moved > 0) {
+            bytes += moved;
+            st[r.op].bytes += moved;
+        }
+        add(&st[r.op].lat, lat);
+        add(&st[r.op].rec, r.dur / 1e9);
+    }
+    t = now() - t0;
+    for (i = 0; i < ndirs; ++i)
+        if (dirs[i] != NULL) fs_closedir(dirs[i]);
+    fs_closefs(f);
+    fclose(log);
+
+    printf("{\"log\": \"%s\", \"timed\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f, \"diverged\": %ld, "
+           "\"skipped\": %ld,\n \"results\": [", argv[optind], timed, nops, t,
+           t > 0 ? nops / t : 0, t > 0 ? bytes / t / (1 << 20) : 0, diverged,
+           skipped);
+    for (c = 0, i = 0; i < FS_NOPS; ++i) {
+        if (st[i].lat.n == 0) continue;
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %ld, \"bytes\": %ld,\n     ",
+               c++ ? "," : "", opname[i], st[i].lat.n, st[i].bytes);
+        print_lat("lat_us", &st[i].lat);
+        printf(",\n     ");
+        print_lat("rec_lat_us", &st[i].rec);
+        printf("}");
+        free(st[i].lat.v);
+        free(st[i].rec.v);
+    }
+    printf("\n]}\n");
+    free(dirs);
+    free(fdmap);
+    free(buf);
+    return 0;
+}
@@ -1,9 +1,7 @@
 #ifndef FS_H_INCLUDED_
 #define FS_H_INCLUDED_
 
-#ifndef size_t
-typedef  unsigned int size_t;
-#endif
+#include <stddef.h>
 
 typedef struct inode_ {
     int mode;
@@ -30,9 +28,111 @@ enum FS_FPOS{
 	FS_END = 2
 };
 
+enum FS_BACKEND {
+    FS_BK_STDIO = 0,        /* FILE* with fseek + fread/fwrite */
+    FS_BK_PIO = 1,          /* pread/pwrite on a file descriptor */
+    FS_BK_MEM = 2,          /* RAM disk, never written to a file */
+    FS_BK_MMAP = 3          /* image mapped, blocks used in place */
+};
+
+enum FS_OPT_FLAGS {
+    FS_OPT_MMAP = 1,        /* same as backend = FS_BK_MMAP */
+    FS_OPT_JOURNAL = 2      /* fs_creatfs_opt: journal metadata updates;
+                               such images are never mapped */
+};
+
+typedef struct fs_opts_ {
+    size_t cache_size;      /* bytes of block cache, 0 for the default */
+    int flags;              /* FS_OPT_* */
+    int backend;            /* FS_BK_* */
+    int flush_interval;     /* ms between background write-back passes,
+                               0 for no flusher thread */
+    int dirty_expire;       /* ms a block may stay dirty, 0 for 30 s */
+    int dirty_ratio;        /* percent of the cache that may be dirty
+                               before all of it is written, 0 for 10 */
+    int journal_blocks;     /* size of the journal, 0 for 1024 */
+    int aio_threads;        /* workers for fs_submit_*, 0 for 4 */
+} fs_opts;
+
+/* one buffer of a scatter/gather request */
+typedef struct fs_iovec_ {
+    void * base;
+    size_t len;
+} fs_iovec;
+
+/* a finished asynchronous request */
+typedef struct fs_completion_ {
+    int id;                 /* as returned by fs_submit_* */
+    int result;             /* what fs_pread/fs_pwrite would return */
+    void * user;
+} fs_completion;
+
+typedef struct fs_cachestats_ {
+    unsigned long meta_hits;
+    unsigned long meta_misses;
+    unsigned long data_hits;
+    unsigned long data_misses;
+} fs_cachestats;
+
+/* counters since the file system was opened, see fs_getstats() */
+typedef struct fs_stats_ {
+    unsigned long meta_hits;        /* block cache lookups, as fs_cachestats */
+    unsigned long meta_misses;
+    unsigned long data_hits;
+    unsigned long data_misses;
+    unsigned long evictions;        /* cached blocks dropped for others */
+    unsigned long writebacks;       /* dirty blocks written home */
+    unsigned long blk_reads;        /* blocks read from the image */
+    unsigned long blk_writes;       /* blocks written to the image */
+    unsigned long readahead;        /* blocks read ahead of use */
+    unsigned long map_loads;        /* indirect and extent blocks read to map
+                                       file blocks */
+    unsigned long lookups;          /* names looked up in directories */
+    unsigned long dcache_hits;      /* lookups answered by the dentry cache */
+    unsigned long dirents_scanned;  /* entries and index slots examined by
+                                       the other lookups */
+    unsigned long block_allocs;     /* allocator calls */
+    unsigned long block_frees;
+    unsigned long inode_allocs;
+    unsigned long inode_frees;
+} fs_stats;
+
+/* the public calls, as named in traces and recorded logs */
+enum {
+    FS_OP_SYNC, FS_OP_FSYNC, FS_OP_CHDIR, FS_OP_OPEN, FS_OP_CLOSE,
+    FS_OP_READ, FS_OP_WRITE, FS_OP_READV, FS_OP_WRITEV, FS_OP_PREAD,
+    FS_OP_PWRITE, FS_OP_SEEK, FS_OP_FSTAT, FS_OP_REMOVE, FS_OP_MKDIR,
+    FS_OP_REMOVEDIR, FS_OP_OPENDIR, FS_OP_NEXTENT, FS_OP_CLOSEDIR,
+    FS_OP_WAIT,
+    FS_NOPS
+};
+
+/*
+ * A log written by fs_record_start() is the int FS_REC_MAGIC followed by
+ * one fs_rec per finished call, in the order they finished, each
+ * followed by path_len bytes of path (no NUL).
+ */
+#define FS_REC_MAGIC 0x31637266
+
+typedef struct fs_rec_ {
+    long long start;        /* ns after fs_record_start() */
+    int dur;                /* ns */
+    short op;               /* FS_OP_* */
+    unsigned short path_len;
+    int tid;                /* calling thread, numbered from 1 */
+    int fd;                 /* descriptor, or directory number */
+    long long arg;          /* bytes asked for, open mode or seek offset */
+    unsigned int off;       /* fs_pread/fs_pwrite offset, seek mode */
+    int ret;
+} fs_rec;
+
 fs * fs_creatfs(const char * fname, int block_num, int inode_num);
+fs * fs_creatfs_opt(const char * fname, int block_num, int inode_num, const fs_opts* opts);
 fs * fs_openfs(const char* fname);
+fs * fs_openfs_opt(const char* fname, const fs_opts* opts);
 void fs_closefs(fs*);
+int fs_sync(fs*);
+int fs_fsync(fs*, int fd);
 int fs_errno(fs*);
 void fs_pwd(fs*, char * buf, size_t buf_len);
 int fs_chdir(fs*, const char* dir);
@@ -40,9 +140,17 @@ int fs_open(fs*, const char* fname, int mode);
 void fs_close(fs*, int fd);
 int fs_read(fs*, int fd, void* buf, size_t size);
 int fs_write(fs*, int fd, const void* buf, size_t size);
+int fs_readv(fs*, int fd, const fs_iovec* iov, int cnt);
+int fs_writev(fs*, int fd, const fs_iovec* iov, int cnt);
+int fs_pread(fs*, int fd, void* buf, size_t size, unsigned int offset);
+int fs_pwrite(fs*, int fd, const void* buf, size_t size, unsigned int offset);
 int fs_seek(fs*, int fd, int offset, int mode);
 unsigned int fs_tell(fs*, int fd);
 int fs_eof(fs*, int fd);
+int fs_submit_read(fs*, int fd, void* buf, size_t size, unsigned int offset, void* user);
+int fs_submit_write(fs*, int fd, const void* buf, size_t size, unsigned int offset, void* user);
+int fs_poll(fs*, fs_completion* c, int max);
+int fs_wait(fs*, fs_completion* c, int max);
 int fs_fstat(fs*, int fd, inode* inode);
 int fs_remove(fs*, const char* path);
 int fs_mkdir(fs*, const char* path);
@@ -51,5 +159,12 @@ fs_dir * fs_opendir(fs*, const char* dir);
 int fs_nextent(fs_dir*, char* buf, size_t buf_len);
 void fs_closedir(fs_dir*);
 int fs_link(fs*, const char* src, const char* dst);
+void fs_cachestat(fs*, fs_cachestats* st);
+void fs_getstats(fs*, fs_stats* st);
+int fs_trace_start(fs*, int nevents);
+void fs_trace_stop(fs*);
+int fs_trace_dump(fs*, const char* fname);
+int fs_record_start(fs*, const char* fname);
+void fs_record_stop(fs*);
 
 #endif
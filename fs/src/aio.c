@@ -0,0 +1,194 @@
+#include "fs_impl.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Asynchronous reads and writes. fs_submit_read() and fs_submit_write()
+ * queue a request and return its id at once; a pool of worker threads,
+ * started on the first submission, carries requests out with
+ * fs_pread()/fs_pwrite() and moves them to the completion queue, from
+ * which fs_poll() and fs_wait() hand them back in the order they
+ * finished. Requests name their offset, the descriptor's own offset is
+ * left alone. fs_closefs() lets queued requests run to the end first.
+ */
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+struct aioreq_ {
+    int id;
+    int op;
+    int fd;
+    void * buf;
+    size_t size;
+    unsigned int off;
+    void * user;
+    int result;
+    struct aioreq_ * next;
+};
+
+static void push(aioreq ** head, aioreq ** tail, aioreq * r) {
+    r->next = NULL;
+    if (*tail) (*tail)->next = r;
+    else *head = r;
+    *tail = r;
+}
+
+static aioreq * pop(aioreq ** head, aioreq ** tail) {
+    aioreq * r = *head;
+    if (r != NULL) {
+        *head = r->next;
+        if (*head == NULL) *tail = NULL;
+    }
+    return r;
+}
+
+static void * worker(void * arg) {
+    fs * f = arg;
+    aioctl * a = &f->aio;
+    aioreq * r;
+
+    pthread_mutex_lock(&a->mu);
+    for (;;) {
+        while (a->head == NULL && !a->stop)
+            pthread_cond_wait(&a->work, &a->mu);
+        if ((r = pop(&a->head, &a->tail)) == NULL) break;
+        pthread_mutex_unlock(&a->mu);
+
+        if (r->op == AIO_READ)
+            r->result = fs_pread(f, r->fd, r->buf, r->size, r->off);
+        else
+            r->result = fs_pwrite(f, r->fd, r->buf, r->size, r->off);
+
+        pthread_mutex_lock(&a->mu);
+        push(&a->done, &a->done_tail, r);
+        pthread_cond_broadcast(&a->ready);
+    }
+    pthread_mutex_unlock(&a->mu);
+    return NULL;
+}
+
+void aio_init(fs * f, const fs_opts * opts) {
+    aioctl * a = &f->aio;
+    memset(a, 0, sizeof(*a));
+    a->nthread = opts && opts->aio_threads > 0 ? opts->aio_threads : AIO_THREADS;
+    a->next_id = 1;
+    pthread_mutex_init(&a->mu, NULL);
+    pthread_cond_init(&a->work, NULL);
+    pthread_cond_init(&a->ready, NULL);
+}
+
+/* start the workers; called with a->mu held */
+static int start(fs * f) {
+    aioctl * a = &f->aio;
+    int i;
+    a->threads = malloc(a->nthread * sizeof(pthread_t));
+    if (a->threads == NULL) return 0;
+    for (i = 0; i < a->nthread; ++i)
+        if (pthread_create(&a->threads[i], NULL, worker, f) != 0)
+            break;
+    a->started = i;
+    return i > 0;
+}
+
+/* finish every queued request and stop the workers */
+void aio_stop(fs * f) {
+    aioctl * a = &f->aio;
+    int i;
+    pthread_mutex_lock(&a->mu);
+    a->stop = 1;
+    pthread_cond_broadcast(&a->work);
+    pthread_mutex_unlock(&a->mu);
+    for (i = 0; i < a->started; ++i)
+        pthread_join(a->threads[i], NULL);
+    a->started = 0;
+}
+
+void aio_destroy(fs * f) {
+    aioctl * a = &f->aio;
+    aioreq * r;
+    while ((r = pop(&a->head, &a->tail)) != NULL)
+        free(r);
+    while ((r = pop(&a->done, &a->done_tail)) != NULL)
+        free(r);
+    free(a->threads);
+    pthread_cond_destroy(&a->ready);
+    pthread_cond_destroy(&a->work);
+    pthread_mutex_destroy(&a->mu);
+}
+
+static int submit(fs * f, int op, int fd, void * buf, size_t size,
+                  unsigned int off, void * user) {
+    aioctl * a = &f->aio;
+    aioreq * r = malloc(sizeof(*r));
+    int id;
+
+    if (r == NULL) return -1;
+    r->op = op;
+    r->fd = fd;
+    r->buf = buf;
+    r->size = size;
+    r->off = off;
+    r->user = user;
+    pthread_mutex_lock(&a->mu);
+    if (a->stop || (a->started == 0 && !start(f))) {
+        pthread_mutex_unlock(&a->mu);
+        free(r);
+        return -1;
+    }
+    id = r->id = a->next_id;
+    a->next_id = a->next_id == 0x7fffffff ? 1 : a->next_id + 1;
+    a->pending++;
+    push(&a->head, &a->tail, r);
+    pthread_cond_signal(&a->work);
+    pthread_mutex_unlock(&a->mu);
+    return id;
+}
+
+int fs_submit_read(fs * f, int fd, void * buf, size_t size,
+                   unsigned int offset, void * user) {
+    return submit(f, AIO_READ, fd, buf, size, offset, user);
+}
+
+int fs_submit_write(fs * f, int fd, const void * buf, size_t size,
+                    unsigned int offset, void * user) {
+    return submit(f, AIO_WRITE, fd, (void*) buf, size, offset, user);
+}
+
+/* move up to max completions to c; called with a->mu held */
+static int reap(aioctl * a, fs_completion * c, int max) {
+    aioreq * r;
+    int n = 0;
+    while (n < max && (r = pop(&a->done, &a->done_tail)) != NULL) {
+        c[n].id = r->id;
+        c[n].result = r->result;
+        c[n].user = r->user;
+        free(r);
+        ++n;
+    }
+    a->pending -= n;
+    return n;
+}
+
+int fs_poll(fs * f, fs_completion * c, int max) {
+    int n;
+    pthread_mutex_lock(&f->aio.mu);
+    n = reap(&f->aio, c, max);
+    pthread_mutex_unlock(&f->aio.mu);
+    return n;
+}
+
+int fs_wait(fs * f, fs_completion * c, int max) {
+    aioctl * a = &f->aio;
+    long t0;
+    int n;
+    if (max <= 0) return 0;
+    t0 = trace_begin(f);
+    pthread_mutex_lock(&a->mu);
+    while (a->done == NULL && a->pending > 0)
+        pthread_cond_wait(&a->ready, &a->mu);
+    n = reap(a, c, max);
+    pthread_mutex_unlock(&a->mu);
+    api_end(f, FS_OP_WAIT, t0, n, -1, max, 0, NULL);
+    return n;
+}
@@ -0,0 +1,430 @@
+#include "fs_impl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * Storage backends. Every backend moves whole blocks addressed by their
+ * absolute number in the image (block 0 is the superblock).
+ *
+ *   stdio  FILE* with fseek + fread/fwrite
+ *   pio    a file descriptor with pread/pwrite, no seek or stdio buffer
+ *   mem    a private calloc'ed image; nothing ever reaches a file
+ *   mmap   the image mapped shared; base is exported so the block cache
+ *          and the inode table can use blocks in place
+ *
+ * Backends may be called from several threads at once.
+ */
+
+#define PIO_IOV_MAX 256     /* blocks per pwritev, well below IOV_MAX */
+
+typedef struct stdio_be_ {
+    backend be;
+    FILE * fp;
+} stdio_be;
+
+typedef struct fd_be_ {
+    backend be;
+    int fd;
+    pthread_mutex_t mu; /* mmap: guards the range below */
+    long dirty_lo;      /* mmap: byte range written since the last flush */
+    long dirty_hi;
+} fd_be;
+
+typedef struct mem_be_ {
+    backend be;
+    char * d;
+} mem_be;
+
+/* grow a new, empty image to nblk blocks of zeros without writing them */
+static int extend(int fd, long nblk) {
+    return ftruncate(fd, (off_t) nblk * blocksz) == 0;
+}
+
+/* stdio */
+
+/* the stream lock keeps each seek together with its transfer */
+
+static int stdio_read(backend * be, long blk, void * buf, int nblk) {
+    FILE * fp = ((stdio_be*) be)->fp;
+    size_t n;
+    flockfile(fp);
+    fseek(fp, blk * blocksz, SEEK_SET);
+    n = fread(buf, blocksz, nblk, fp);
+    funlockfile(fp);
+    if (n < (size_t) nblk)
+        memset((char*) buf + n * blocksz, 0, (nblk - n) * blocksz);
+    return 1;
+}
+
+static int stdio_write(backend * be, long blk, const void * buf, int nblk) {
+    FILE * fp = ((stdio_be*) be)->fp;
+    int ret;
+    flockfile(fp);
+    fseek(fp, blk * blocksz, SEEK_SET);
+    ret = fwrite(buf, blocksz, nblk, fp) == (size_t) nblk;
+    funlockfile(fp);
+    return ret;
+}
+
+static int stdio_readv(backend * be, long blk, char * const * bufs, int nblk) {
+    FILE * fp = ((stdio_be*) be)->fp;
+    int i, eof = 0;
+    flockfile(fp);
+    fseek(fp, blk * blocksz, SEEK_SET);
+    for (i = 0; i < nblk; ++i) {
+        size_t n = eof ? 0 : fread(bufs[i], 1, blocksz, fp);
+        if (n < blocksz) {
+            memset(bufs[i] + n, 0, blocksz - n);
+            eof = 1;
+        }
+    }
+    funlockfile(fp);
+    return 1;
+}
+
+static int stdio_writev(backend * be, long blk, char * const * bufs, int nblk) {
+    FILE * fp = ((stdio_be*) be)->fp;
+    int i, ret = 1;
+    flockfile(fp);
+    fseek(fp, blk * blocksz, SEEK_SET);
+    for (i = 0; ret && i < nblk; ++i)
+        ret = fwrite(bufs[i], blocksz, 1, fp) == 1;
+    funlockfile(fp);
+    return ret;
+}
+
+static int stdio_flush(backend * be) {
+    FILE * fp = ((stdio_be*) be)->fp;
+    return fflush(fp) == 0 && fdatasync(fileno(fp)) == 0;
+}
+
+static long stdio_size(backend * be) {
+    struct stat st;
+    if (fstat(fileno(((stdio_be*) be)->fp), &st) != 0) return 0;
+    return st.st_size;
+}
+
+static void stdio_close(backend * be) {
+    fclose(((stdio_be*) be)->fp);
+    free(be);
+}
+
+static const backend_ops stdio_ops = {
+    stdio_read, stdio_write, stdio_readv, stdio_writev, stdio_flush, stdio_size, stdio_close
+};
+
+/* pread/pwrite */
+
+static int pio_read(backend * be, long blk, void * buf, int nblk) {
+    int fd = ((fd_be*) be)->fd;
+    size_t len = (size_t) nblk * blocksz;
+    size_t done = 0;
+    ssize_t n;
+    while (done < len) {
+        n = pread(fd, (char*) buf + done, len - done, blk * blocksz + done);
+        if (n < 0) return 0;
+        if (n == 0) {
+            memset((char*) buf + done, 0, len - done);
+            break;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+static int pio_write(backend * be, long blk, const void * buf, int nblk) {
+    int fd = ((fd_be*) be)->fd;
+    size_t len = (size_t) nblk * blocksz;
+    size_t done = 0;
+    ssize_t n;
+    while (done < len) {
+        n = pwrite(fd, (const char*) buf + done, len - done, blk * blocksz + done);
+        if (n <= 0) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+static int pio_readv(backend * be, long blk, char * const * bufs, int nblk) {
+    int fd = ((fd_be*) be)->fd;
+    struct iovec iov[PIO_IOV_MAX];
+    int i, n;
+
+    while (nblk > 0) {
+        n = nblk < PIO_IOV_MAX ? nblk : PIO_IOV_MAX;
+        for (i = 0; i < n; ++i) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = blocksz;
+        }
+        /* a short read, as at the end of the image, goes block by block */
+        if (preadv(fd, iov, n, blk * blocksz) != (ssize_t) n * blocksz) {
+            for (i = 0; i < n; ++i)
+                if (!pio_read(be, blk + i, bufs[i], 1))
+                    return 0;
+        }
+        blk += n;
+        bufs += n;
+        nblk -= n;
+    }
+    return 1;
+}
+
+static int pio_writev(backend * be, long blk, char * const * bufs, int nblk) {
+    int fd = ((fd_be*) be)->fd;
+    struct iovec iov[PIO_IOV_MAX];
+    int i, n;
+
+    while (nblk > 0) {
+        n = nblk < PIO_IOV_MAX ? nblk : PIO_IOV_MAX;
+        for (i = 0; i < n; ++i) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = blocksz;
+        }
+        /* a short write falls back to writing the rest block by block */
+        if (pwritev(fd, iov, n, blk * blocksz) != (ssize_t) n * blocksz) {
+            for (i = 0; i < n; ++i)
+                if (!pio_write(be, blk + i, bufs[i], 1))
+                    return 0;
+        }
+        blk += n;
+        bufs += n;
+        nblk -= n;
+    }
+    return 1;
+}
+
+static int pio_flush(backend * be) {
+    return fdatasync(((fd_be*) be)->fd) == 0;
+}
+
+static long pio_size(backend * be) {
+    struct stat st;
+    if (fstat(((fd_be*) be)->fd, &st) != 0) return 0;
+    return st.st_size;
+}
+
+static void pio_close(backend * be) {
+    close(((fd_be*) be)->fd);
+    free(be);
+}
+
+static const backend_ops pio_ops = {
+    pio_read, pio_write, pio_readv, pio_writev, pio_flush, pio_size, pio_close
+};
+
+/* memory */
+
+static int mem_read(backend * be, long blk, void * buf, int nblk) {
+    if ((blk + nblk) * blocksz > be->len) return 0;
+    memcpy(buf, ((mem_be*) be)->d + blk * blocksz, (size_t) nblk * blocksz);
+    return 1;
+}
+
+static int mem_write(backend * be, long blk, const void * buf, int nblk) {
+    if ((blk + nblk) * blocksz > be->len) return 0;
+    memcpy(((mem_be*) be)->d + blk * blocksz, buf, (size_t) nblk * blocksz);
+    return 1;
+}
+
+static int mem_readv(backend * be, long blk, char * const * bufs, int nblk) {
+    int i;
+    for (i = 0; i < nblk; ++i)
+        if (!mem_read(be, blk + i, bufs[i], 1))
+            return 0;
+    return 1;
+}
+
+static int mem_writev(backend * be, long blk, char * const * bufs, int nblk) {
+    int i;
+    for (i = 0; i < nblk; ++i)
+        if (!mem_write(be, blk + i, bufs[i], 1))
+            return 0;
+    return 1;
+}
+
+static int mem_flush(backend * be) {
+    (void) be;
+    return 1;
+}
+
+static long mem_size(backend * be) {
+    return be->len;
+}
+
+static void mem_close(backend * be) {
+    free(((mem_be*) be)->d);
+    free(be);
+}
+
+static const backend_ops mem_ops = {
+    mem_read, mem_write, mem_readv, mem_writev, mem_flush, mem_size, mem_close
+};
+
+/* mmap */
+
+static void map_mark(fd_be * m, long off, long len) {
+    pthread_mutex_lock(&m->mu);
+    if (off < m->dirty_lo) m->dirty_lo = off;
+    if (off + len > m->dirty_hi) m->dirty_hi = off + len;
+    pthread_mutex_unlock(&m->mu);
+}
+
+static int map_read(backend * be, long blk, void * buf, int nblk) {
+    if ((blk + nblk) * blocksz > be->len) return 0;
+    memcpy(buf, be->base + blk * blocksz, (size_t) nblk * blocksz);
+    return 1;
+}
+
+/* buf may already be the mapped block, then only the range is recorded */
+static int map_write(backend * be, long blk, const void * buf, int nblk) {
+    char * dst = be->base + blk * blocksz;
+    if ((blk + nblk) * blocksz > be->len) return 0;
+    if (buf != dst)
+        memcpy(dst, buf, (size_t) nblk * blocksz);
+    map_mark((fd_be*) be, blk * blocksz, (long) nblk * blocksz);
+    return 1;
+}
+
+static int map_readv(backend * be, long blk, char * const * bufs, int nblk) {
+    int i;
+    for (i = 0; i < nblk; ++i)
+        if (!map_read(be, blk + i, bufs[i], 1))
+            return 0;
+    return 1;
+}
+
+static int map_writev(backend * be, long blk, char * const * bufs, int nblk) {
+    int i;
+    for (i = 0; i < nblk; ++i)
+        if (!map_write(be, blk + i, bufs[i], 1))
+            return 0;
+    return 1;
+}
+
+static int map_flush(backend * be) {
+    fd_be * m = (fd_be*) be;
+    long lo, hi;
+    pthread_mutex_lock(&m->mu);
+    lo = m->dirty_lo;
+    hi = m->dirty_hi;
+    m->dirty_lo = be->len;
+    m->dirty_hi = 0;
+    pthread_mutex_unlock(&m->mu);
+    if (lo < hi && msync(be->base + lo, hi - lo, MS_SYNC) != 0) {
+        map_mark(m, lo, hi - lo);
+        return 0;
+    }
+    return 1;
+}
+
+static long map_size(backend * be) {
+    return be->len;
+}
+
+static void map_close(backend * be) {
+    munmap(be->base, be->len);
+    close(((fd_be*) be)->fd);
+    pthread_mutex_destroy(&((fd_be*) be)->mu);
+    free(be);
+}
+
+static const backend_ops map_ops = {
+    map_read, map_write, map_readv, map_writev, map_flush, map_size, map_close
+};
+
+/*
+ * Open the backend of the given kind on fname. With nblk > 0 the image
+ * is created (or truncated) and extended to nblk blocks as a sparse file
+ * of zeros; otherwise an existing image is opened. The memory backend
+ * copies an existing image into memory and never writes it back; fname
+ * may be NULL when creating.
+ */
+backend * be_open(int kind, const char * fname, long nblk) {
+    backend * be = NULL;
+    int fd;
+
+    if (kind == FS_BK_STDIO) {
+        stdio_be * s;
+        FILE * fp = fopen(fname, nblk > 0 ? "w+b" : "r+b");
+        if (fp == NULL) return NULL;
+        s = calloc(1, sizeof(*s));
+        if (s == NULL) {
+            fclose(fp);
+            return NULL;
+        }
+        s->fp = fp;
+        be = &s->be;
+        be->ops = &stdio_ops;
+    }
+    else if (kind == FS_BK_PIO || kind == FS_BK_MMAP) {
+        fd_be * p;
+        fd = open(fname, nblk > 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+        if (fd < 0) return NULL;
+        p = calloc(1, sizeof(*p));
+        if (p == NULL) {
+            close(fd);
+            return NULL;
+        }
+        p->fd = fd;
+        be = &p->be;
+        be->ops = &pio_ops;
+    }
+    else if (kind == FS_BK_MEM) {
+        mem_be * m = calloc(1, sizeof(*m));
+        backend * src = NULL;
+        if (m == NULL) return NULL;
+        if (nblk <= 0) {
+            src = be_open(FS_BK_PIO, fname, 0);
+            if (src == NULL) {
+                free(m);
+                return NULL;
+            }
+            nblk = src->ops->size(src) / blocksz;
+        }
+        m->be.len = nblk * blocksz;
+        m->d = calloc(nblk, blocksz);
+        if (m->d == NULL || (src && !src->ops->read(src, 0, m->d, nblk))) {
+            if (src) src->ops->close(src);
+            free(m->d);
+            free(m);
+            return NULL;
+        }
+        if (src) src->ops->close(src);
+        m->be.ops = &mem_ops;
+        return &m->be;
+    }
+    else
+        return NULL;
+
+    if (nblk > 0 && !extend(kind == FS_BK_STDIO ? fileno(((stdio_be*) be)->fp) :
+                            ((fd_be*) be)->fd, nblk)) {
+        be->ops->close(be);
+        return NULL;
+    }
+
+    if (kind == FS_BK_MMAP) {
+        fd_be * m = (fd_be*) be;
+        be->len = be->ops->size(be);
+        if (be->len < blocksz) {
+            be->ops->close(be);
+            return NULL;
+        }
+        be->base = mmap(NULL, be->len, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+        if (be->base == MAP_FAILED) {
+            be->base = NULL;
+            be->ops->close(be);
+            return NULL;
+        }
+        m->dirty_lo = be->len;
+        m->dirty_hi = 0;
+        pthread_mutex_init(&m->mu, NULL);
+        be->ops = &map_ops;
+    }
+    return be;
+}
@@ -0,0 +1,470 @@
+#include "fs_impl.h"
+#include <string.h>
+
+/*
+ * Free space and placement.
+ *
+ * Images made by fs_creatfs() are cut into block groups of
+ * BLOCKS_PER_GROUP data blocks. The first block of every group is the
+ * bitmap of that group, one bit per block, set when the block is in use;
+ * group 0 also holds the table of group descriptors right after its
+ * bitmap. The inode table is split evenly across the groups as well, and
+ * a descriptor counts the free blocks and inodes and the directories of
+ * its group.
+ *
+ * New inodes go into the group of their parent directory, except that
+ * directories created in the root are spread over the groups that have
+ * the most room. Blocks of a file are taken from the group of its inode
+ * first, so a tree's inodes, dentries and data stay close together.
+ * alloc_run() looks for the first free block at or after a goal and takes
+ * as many of the blocks following it as are free, up to the number asked
+ * for, so a file written in large pieces stays physically sequential.
+ *
+ * Images with FEAT_BITMAP but without FEAT_GROUPS keep a bitmap in the
+ * first bmap_blocks data blocks and no descriptors. Images without
+ * FEAT_BITMAP keep the original free stack: up to FREE_BLOCK_NUM ids in
+ * the superblock, spilling into a chain of free-list blocks, and a free
+ * list of inodes threaded through next_id.
+ *
+ * The exported functions serialize on f->alock; the static ones and
+ * release_run() expect it held.
+ */
+
+#define HAS_FEAT(f, x) ((f)->sb.feat_magic == FEAT_MAGIC && ((f)->sb.features & (x)))
+#define GD_PER_BLK (blocksz / sizeof(gdesc))
+
+static int stack_alloc(fs *f){
+    int ret = -1;
+    if (f->sb.total_free_block_num  == 0) return -1;
+    -- f->sb.block_cnt;
+    ret = f->sb.free_blocks[f->sb.block_cnt];
+    if (f->sb.block_cnt == 0) {
+        buffer *b = openblk(f, ret, BUF_META);
+        if (b == NULL) {
+            ++f->sb.block_cnt;
+            return -1;
+        }
+        memcpy(f->sb.free_blocks, b->d, sizeof(f->sb.free_blocks));
+        brelse(f, b);
+        f->sb.block_cnt = FREE_BLOCK_NUM;
+    }
+    -- f->sb.total_free_block_num;
+    return ret;
+}
+
+static int stack_free(fs * f, int bid) {
+    if (f->sb.block_cnt == FREE_BLOCK_NUM) {
+        buffer * b = openblk(f, bid, BUF_META);
+        if (b == NULL) {
+            return 0;
+        }
+        memcpy(b->d, f->sb.free_blocks, sizeof(f->sb.free_blocks));
+        b->dirty = 1;
+        brelse(f, b);
+        f->sb.block_cnt = 1;
+        f->sb.free_blocks[0] = bid;
+    }
+    else {
+        f->sb.free_blocks[f->sb.block_cnt++] = bid;
+    }
+    ++ f->sb.total_free_block_num;        
+    return 1;
+}
+
+/* the bitmap block covering group g */
+static int bm_blk(fs * f, int g) {
+    return HAS_FEAT(f, FEAT_GROUPS) ? g * BLOCKS_PER_GROUP : g;
+}
+
+/*
+ * The bitmap block of group g, to be released by the caller. A new
+ * image leaves the bitmaps of all groups but the first as the zeros of
+ * the sparse file. Such a bitmap is set up here on first use by marking
+ * the bitmap block itself, which balloc_init() already counted as used;
+ * every bitmap written before has that bit set.
+ */
+static buffer * getbm(fs * f, int g) {
+    buffer * b = openblk(f, bm_blk(f, g), BUF_META);
+    if (b != NULL && HAS_FEAT(f, FEAT_GROUPS) && !(b->d[0] & 1)) {
+        b->d[0] |= 1;
+        b->dirty = 1;
+    }
+    return b;
+}
+
+/*
+ * Descriptor of group g, NULL if the image has none. *bp is set to its
+ * buffer, to be released by the caller.
+ */
+static gdesc * getgd(fs * f, int g, buffer ** bp) {
+    buffer * b;
+    if (!HAS_FEAT(f, FEAT_GROUPS)) return NULL;
+    b = openblk(f, 1 + g / GD_PER_BLK, BUF_META);
+    if (b == NULL) return NULL;
+    *bp = b;
+    return (gdesc*) b->d + g % GD_PER_BLK;
+}
+
+static void gd_add(fs * f, int g, int blocks, int inodes, int dirs) {
+    buffer * b;
+    gdesc * gd = getgd(f, g, &b);
+    if (gd == NULL) return;
+    gd->free_blocks += blocks;
+    gd->free_inodes += inodes;
+    gd->dirs += dirs;
+    b->dirty = 1;
+    brelse(f, b);
+}
+
+/* first free block at or after goal, wrapping around once; -1 if none */
+static int find_free(fs * f, int goal) {
+    int nblk = f->sb.nblocks;
+    int bid, i;
+
+    if (goal < 0 || goal >= nblk) goal = 0;
+    bid = goal;
+    for (i = 0; i <= f->sb.bmap_blocks; ++i) {
+        int g = bid / BLOCKS_PER_GROUP;
+        int end = (g + 1) * BLOCKS_PER_GROUP;
+        buffer * b;
+        gdesc * gd = getgd(f, g, &b);
+        unsigned char * m;
+
+        if (end > nblk) end = nblk;
+        if (gd != NULL) {
+            int full = gd->free_blocks == 0;
+            brelse(f, b);
+            if (full) {
+                bid = end >= nblk ? 0 : end;
+                continue;
+            }
+        }
+        if ((b = getbm(f, g)) == NULL) return -1;
+        m = (unsigned char*) b->d;
+        while (bid < end) {
+            int o = bid % BLOCKS_PER_GROUP;
+            if (o % 32 == 0 && bid + 32 <= end &&
+                ((unsigned int*) m)[o / 32] == 0xffffffffu) {
+                bid += 32;
+                continue;
+            }
+            if (!(m[o / 8] & (1 << (o % 8)))) {
+                brelse(f, b);
+                return bid;
+            }
+            ++bid;
+        }
+        brelse(f, b);
+        if (bid >= nblk) bid = 0;
+    }
+    return -1;
+}
+
+/*
+ * Set (used != 0) or clear the bits of the n blocks starting at bid,
+ * stopping at the first one already in that state. Returns the number
+ * changed, or -1 on I/O failure.
+ */
+static int mark(fs * f, int bid, int n, int used) {
+    buffer * b = NULL;
+    int i, g = -1, cnt = 0, done = 0, err = 0;
+
+    for (i = 0; i < n && bid + i < f->sb.nblocks; ++i) {
+        int x = bid + i;
+        unsigned char * m;
+        int bit = 1 << (x % 8);
+        if (b == NULL || x / BLOCKS_PER_GROUP != g) {
+            if (cnt) gd_add(f, g, used ? -cnt : cnt, 0, 0);
+            brelse(f, b);
+            g = x / BLOCKS_PER_GROUP;
+            cnt = 0;
+            if ((b = getbm(f, g)) == NULL) {
+                err = 1;
+                break;
+            }
+        }
+        m = (unsigned char*) b->d + (x % BLOCKS_PER_GROUP) / 8;
+        if (!(*m & bit) == !used) {
+            if (used) break;
+            continue;
+        }
+        *m ^= bit;
+        b->dirty = 1;
+        ++cnt;
+        ++done;
+    }
+    brelse(f, b);
+    if (cnt) gd_add(f, g, used ? -cnt : cnt, 0, 0);
+    /* the bits flipped before a failed group still count */
+    f->sb.total_free_block_num += used ? -done : done;
+    return err ? -1 : done;
+}
+
+/*
+ * First free block at or after goal that the journal does not hold,
+ * with *want cut so that the run stays clear of held blocks; -1 if none.
+ * Every held run is skipped at most once before the search wraps and
+ * once after.
+ */
+static int find_unheld(fs * f, int goal, int * want) {
+    int bid, next, i;
+    if (f->sb.total_free_block_num == 0) return -1;
+    for (i = 0; i <= f->jnl.nfree; ++i) {
+        if ((bid = find_free(f, goal)) < 0) return -1;
+        if ((next = jnl_held(f, bid, want)) < 0) return bid;
+        goal = next;
+    }
+    return -1;
+}
+
+static int alloc_locked(fs * f, int goal, int want, int * got) {
+    int bid, n;
+
+    if (!HAS_FEAT(f, FEAT_BITMAP)) {
+        bid = stack_alloc(f);
+        if (got && bid >= 0) *got = 1;
+        return bid;
+    }
+
+    if (want <= 0) return -1;
+    if (goal < 0) goal = f->sb.alloc_hint;
+    /* blocks freed under the journal come back at a checkpoint */
+    if ((bid = find_unheld(f, goal, &want)) < 0 &&
+        (!jnl_has_deferred(f) || !jnl_checkpoint(f) ||
+         (bid = find_unheld(f, goal, &want)) < 0))
+        return -1;
+    if ((n = mark(f, bid, want, 1)) <= 0) return -1;
+    f->sb.alloc_hint = bid + n;
+    if (got) *got = n;
+    return bid;
+}
+
+/*
+ * Allocate up to want contiguous blocks, starting as close after goal as
+ * possible (goal < 0: after the last allocation). Returns the first
+ * block and sets *got to the length of the run, or returns -1.
+ */
+int alloc_run(fs * f, int goal, int want, int * got) {
+    long t0 = trace_begin(f);
+    int bid;
+    if (got) *got = 0;
+    stat_add(f, ST_BALLOC, 1);
+    pthread_mutex_lock(&f->alock);
+    bid = alloc_locked(f, goal, want, got);
+    pthread_mutex_unlock(&f->alock);
+    trace_end(f, TR_ALLOC, t0, bid);
+    return bid;
+}
+
+static int free_run_now(fs * f, int bid, int n) {
+    int i;
+
+    if (!HAS_FEAT(f, FEAT_BITMAP)) {
+        for (i = 0; i < n; ++i)
+            if (!stack_free(f, bid + i))
+                return 0;
+        return 1;
+    }
+    return mark(f, bid, n, 0) >= 0;
+}
+
+/*
+ * Give back the n blocks starting at bid. Under the journal their bits
+ * are cleared at once, so that the transaction freeing them records it,
+ * but the journal holds them from reuse until a checkpoint.
+ */
+int free_run(fs * f, int bid, int n) {
+    int ret;
+    stat_add(f, ST_BFREE, 1);
+    pthread_mutex_lock(&f->alock);
+    if (f->jnl.on)
+        ret = jnl_defer_free(f, bid, n) &&
+              (!HAS_FEAT(f, FEAT_BITMAP) || mark(f, bid, n, 0) >= 0);
+    else
+        ret = free_run_now(f, bid, n);
+    pthread_mutex_unlock(&f->alock);
+    return ret;
+}
+
+/* the journal no longer holds the n blocks from bid; alock is held */
+int release_run(fs * f, int bid, int n) {
+    /* a bitmap has them marked free already */
+    if (HAS_FEAT(f, FEAT_BITMAP)) return 1;
+    return free_run_now(f, bid, n);
+}
+
+int alloc_blk(fs * f) {
+    return alloc_run(f, -1, 1, NULL);
+}
+
+int free_blk(fs * f, int bid) {
+    return free_run(f, bid, 1);
+}
+
+/* where the blocks of inode ino should preferably go, -1 for anywhere */
+int ino_goal(fs * f, int ino) {
+    if (!HAS_FEAT(f, FEAT_GROUPS)) return -1;
+    return ino / f->sb.ipg * BLOCKS_PER_GROUP;
+}
+
+/* the group to put a new inode in, -1 if all are full */
+static int pick_group(fs * f, int parent, int dir) {
+    int ng = f->sb.bmap_blocks;
+    int pg = parent / f->sb.ipg;
+    int i, best = -1;
+    buffer * b;
+    gdesc * gd;
+
+    if (dir && parent == 0) {
+        /* spread top-level directories: fewest directories among the
+         * groups with at least the average of free inodes and blocks */
+        int avg_i = 0, avg_b = 0, best_dirs = 0;
+        for (i = 0; i < ng; ++i) {
+            if ((gd = getgd(f, i, &b)) == NULL) return -1;
+            avg_i += gd->free_inodes / ng;
+            avg_b += gd->free_blocks / ng;
+            brelse(f, b);
+        }
+        for (i = 0; i < ng; ++i) {
+            if ((gd = getgd(f, i, &b)) == NULL) return -1;
+            if (gd->free_inodes > 0 && gd->free_inodes >= avg_i &&
+                gd->free_blocks >= avg_b &&
+                (best == -1 || gd->dirs < best_dirs)) {
+                best = i;
+                best_dirs = gd->dirs;
+            }
+            brelse(f, b);
+        }
+        if (best != -1) return best;
+    }
+
+    /* the parent's group, or the next one with room for inode and data */
+    for (i = 0; i < ng; ++i) {
+        int g = (pg + i) % ng, room;
+        if ((gd = getgd(f, g, &b)) == NULL) return -1;
+        room = gd->free_inodes > 0;
+        if (room && gd->free_blocks > 0) {
+            brelse(f, b);
+            return g;
+        }
+        brelse(f, b);
+        if (room && best == -1) best = g;
+    }
+    return best;
+}
+
+static int ialloc_locked(fs * f, int parent, int dir) {
+    int g, i, end;
+    buffer * b;
+    gdesc * gd;
+
+    if (!HAS_FEAT(f, FEAT_GROUPS)) {
+        i = f->sb.free_inode;
+        if (i == 0) return -1;
+        f->sb.free_inode = iget(f, i)->next_id;
+    }
+    else {
+        if ((g = pick_group(f, parent, dir)) == -1) return -1;
+        if ((gd = getgd(f, g, &b)) == NULL) return -1;
+        end = (g + 1) * f->sb.ipg;
+        if (end > f->sb.inode_cnt) end = f->sb.inode_cnt;
+        i = g * f->sb.ipg + gd->ihint;
+        for (; i < end && iget(f, i)->mode != 0; ++i)
+            ;
+        if (i >= end)
+            for (i = g * f->sb.ipg; i < end && iget(f, i)->mode != 0; ++i)
+                ;
+        if (i < end) {
+            gd->free_inodes--;
+            gd->dirs += dir != 0;
+            gd->ihint = i + 1 - g * f->sb.ipg;
+            b->dirty = 1;
+        }
+        brelse(f, b);
+        if (i >= end) return -1;
+    }
+    memset(iget(f, i), 0, sizeof(inode));
+    iget(f, i)->mode = I_EXTENT;
+    idirty(f, i);
+    return i;
+}
+
+/*
+ * Allocate an inode for a new file (or directory, if dir is set) in
+ * parent. The inode comes back cleared with I_EXTENT set; -1 if there is
+ * none left.
+ */
+int ialloc(fs * f, int parent, int dir) {
+    int ret;
+    stat_add(f, ST_IALLOC, 1);
+    pthread_mutex_lock(&f->alock);
+    ret = ialloc_locked(f, parent, dir);
+    pthread_mutex_unlock(&f->alock);
+    return ret;
+}
+
+/* put inode ino, already released and cleared, back */
+void ifree(fs * f, int ino, int dir) {
+    stat_add(f, ST_IFREE, 1);
+    pthread_mutex_lock(&f->alock);
+    if (!HAS_FEAT(f, FEAT_GROUPS)) {
+        iget(f, ino)->next_id = f->sb.free_inode;
+        f->sb.free_inode = ino;
+        idirty(f, ino);
+    }
+    else
+        gd_add(f, ino / f->sb.ipg, 0, 1, dir ? -1 : 0);
+    pthread_mutex_unlock(&f->alock);
+}
+
+/*
+ * Format the groups of a new image of nblk data blocks and ninode
+ * inodes, all free but the root inode 0. The image is all zeros, so
+ * only the descriptors and the bitmap of group 0 are written; the other
+ * bitmaps are set up as they are first used, see getbm().
+ */
+int balloc_init(fs * f, int nblk, int ninode) {
+    superblock * sb = &f->sb;
+    int ng = (nblk + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+    int i;
+    buffer * b;
+
+    sb->feat_magic = FEAT_MAGIC;
+    sb->features |= FEAT_BITMAP | FEAT_GROUPS;
+    sb->nblocks = nblk;
+    sb->bmap_blocks = ng;
+    sb->gdt_blocks = (ng + GD_PER_BLK - 1) / GD_PER_BLK;
+    sb->ipg = (ninode + ng - 1) / ng;
+    sb->block_cnt = 0;
+    sb->free_inode = 0;
+    sb->total_free_block_num = 0;
+    sb->alloc_hint = 0;
+    if (1 + sb->gdt_blocks >= nblk) return 0;
+
+    for (i = 0; i < sb->gdt_blocks; ++i) {
+        b = getblk(f, 1 + i, BUF_META);
+        if (b == NULL) return 0;
+        memset(b->d, 0, blocksz);
+        b->dirty = 1;
+        brelse(f, b);
+    }
+    if ((b = getblk(f, bm_blk(f, 0), BUF_META)) == NULL) return 0;
+    memset(b->d, 0, blocksz);
+    b->dirty = 1;
+    brelse(f, b);
+    for (i = 0; i < ng; ++i) {
+        int len = nblk - i * BLOCKS_PER_GROUP;
+        int ilen = ninode - i * sb->ipg;
+        if (len > BLOCKS_PER_GROUP) len = BLOCKS_PER_GROUP;
+        if (ilen > sb->ipg) ilen = sb->ipg;
+        if (ilen < 0) ilen = 0;
+        /* less the bitmap block */
+        gd_add(f, i, len - 1, ilen, 0);
+        sb->total_free_block_num += len - 1;
+    }
+    if ((b = getbm(f, 0)) == NULL) return 0;
+    brelse(f, b);
+    if (mark(f, 1, sb->gdt_blocks, 1) != sb->gdt_blocks) return 0;
+    gd_add(f, 0, 0, -1, 1);
+    return 1;
+}
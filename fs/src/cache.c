@@ -0,0 +1,673 @@
+#include "fs_impl.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Block cache: a fixed pool of buffers indexed by a hash on the block id.
+ * The pool size is chosen when the file system is opened or created.
+ *
+ * The pool is split into a metadata partition (directory, indirect and
+ * free-list blocks) and a data partition, and each partition runs the 2Q
+ * policy: a block seen for the first time enters the FIFO a1in; when it
+ * falls out of a1in only its id is remembered on the ghost queue a1out,
+ * and a block referenced again while on a1out is promoted to the LRU
+ * queue am. A single streaming pass over a large file therefore only
+ * cycles a1in of the data partition and never touches metadata.
+ *
+ * On a backend that exports the image (mmap) the buffers carry no memory
+ * of their own: d points at the block inside the image, and writing a
+ * buffer back only records the range that the backend has to flush.
+ *
+ * So that threads working on different files do not queue on one lock,
+ * the cache is cut into up to CACHE_SHARDS shards, each a complete 2Q
+ * cache with its own lock, hash table and partitions. Every SHARD_SPAN
+ * consecutive blocks go to the same shard, which keeps the runs that
+ * write-back coalesces together. Only openblk() and brelse() touch a
+ * single shard; whole-cache scans lock all of them.
+ */
+
+#define SHARD_SPAN 16
+
+static bshard * shard_of(bcache * bc, int bid) {
+    unsigned int h = (unsigned int) (bid / SHARD_SPAN) * 2654435761u;
+    return &bc->shards[(h >> 16) & (bc->nshard - 1)];
+}
+
+static unsigned int hashblk(bshard * sh, int bid) {
+    return ((unsigned int) bid * 2654435761u) & (sh->nhash - 1);
+}
+
+static void q_init(bqueue * q) {
+    q->head.next = q->head.prev = &q->head;
+    q->len = 0;
+}
+
+static void q_remove(buffer * b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    b->q->len--;
+    b->q = NULL;
+}
+
+static void q_push_front(bqueue * q, buffer * b) {
+    b->next = q->head.next;
+    b->prev = &q->head;
+    q->head.next->prev = b;
+    q->head.next = b;
+    b->q = q;
+    q->len++;
+}
+
+static void q_move_front(bqueue * q, buffer * b) {
+    q_remove(b);
+    q_push_front(q, b);
+}
+
+/*
+ * What evicting b takes: 0 nothing, 1 writing it home first, 2 more
+ * than that -- it holds metadata not yet committed to the journal, which
+ * must not reach its home block.
+ */
+static int evict_cost(fs * f, buffer * b) {
+    if (!b->dirty && !b->ckpt) return 0;
+    if (b->dirty && b->cls == BUF_META && f->jnl.on) return 2;
+    return 1;
+}
+
+/*
+ * Least recently queued buffer of q that is not pinned. With the flusher
+ * running, a clean buffer near the tail is taken over a dirty one so
+ * that the caller does not have to wait for a write. Uncommitted
+ * metadata is never taken.
+ */
+static buffer * q_victim(fs * f, bqueue * q) {
+    buffer * b, * ok = NULL;
+    int n = 0, c;
+    for (b = q->head.prev; b != &q->head; b = b->prev, ++n) {
+        if (__atomic_load_n(&b->pin, __ATOMIC_ACQUIRE)) continue;
+        c = evict_cost(f, b);
+        if (c == 0 && (f->fl.on ? n < 32 : ok == NULL)) return b;
+        if (c < 2 && ok == NULL) ok = b;
+        if (ok != NULL && (!f->fl.on || n >= 32)) break;
+    }
+    return ok;
+}
+
+static void hash_insert(bshard * sh, buffer * b) {
+    unsigned int h = hashblk(sh, b->bid);
+    b->hnext = sh->hash[h];
+    sh->hash[h] = b;
+}
+
+static void hash_remove(bshard * sh, buffer * b) {
+    buffer ** pp = &sh->hash[hashblk(sh, b->bid)];
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+}
+
+static buffer * hash_find(bshard * sh, int bid) {
+    buffer * b;
+    for (b = sh->hash[hashblk(sh, bid)]; b != NULL; b = b->hnext)
+        if (b->bid == bid)
+            return b;
+    return NULL;
+}
+
+static void part_init(bpart * p, int cap) {
+    p->cap = p->size = cap;
+    p->kin = cap / 4 > 0 ? cap / 4 : 1;
+    p->kout = cap / 2 > 0 ? cap / 2 : 1;
+    q_init(&p->freeq);
+    q_init(&p->a1in);
+    q_init(&p->am);
+    q_init(&p->a1out);
+    q_init(&p->ghosts);
+    p->hits = p->misses = 0;
+}
+
+/* share s of total split over n */
+static int share(int total, int s, int n) {
+    return total / n + (s < total % n);
+}
+
+int bcache_init(fs * f, size_t cache_size, int mapped) {
+    bcache * bc = &f->bc;
+    int nbuf, nmeta, ntotal, nshard, i, s, k;
+    buffer * b;
+
+    memset(bc, 0, sizeof(*bc));
+    if (cache_size == 0) cache_size = DEFAULT_CACHE_SIZE;
+    nbuf = cache_size / blocksz;
+    if (nbuf < MIN_CACHE_BLOCKS) nbuf = MIN_CACHE_BLOCKS;
+    nmeta = nbuf / META_CACHE_SHARE;
+    if (nmeta < MIN_CACHE_BLOCKS / 2) nmeta = MIN_CACHE_BLOCKS / 2;
+    /* no shard gets fewer metadata buffers than a small cache has */
+    for (nshard = 1; nshard * 2 <= CACHE_SHARDS &&
+         nmeta / (nshard * 2) >= MIN_CACHE_BLOCKS; nshard *= 2)
+        ;
+
+    bc->shards = calloc(nshard, sizeof(bshard));
+    if (bc->shards == NULL) return 0;
+    bc->nshard = nshard;
+    ntotal = nbuf;
+    for (s = 0; s < nshard; ++s) {
+        bshard * sh = &bc->shards[s];
+        int sm = share(nmeta, s, nshard), sd = share(nbuf - nmeta, s, nshard);
+        pthread_mutex_init(&sh->lock, NULL);
+        part_init(&sh->part[BUF_META], sm);
+        part_init(&sh->part[BUF_DATA], sd);
+        k = sm + sd + sh->part[BUF_META].kout + sh->part[BUF_DATA].kout;
+        ntotal += sh->part[BUF_META].kout + sh->part[BUF_DATA].kout;
+        for (sh->nhash = 1; sh->nhash < k; sh->nhash <<= 1)
+            ;
+        sh->hash = calloc(sh->nhash, sizeof(buffer*));
+        if (sh->hash == NULL) {
+            bcache_destroy(f);
+            return 0;
+        }
+    }
+
+    bc->nbuf = nbuf;
+    bc->bufs = calloc(ntotal, sizeof(buffer));
+    if (!mapped)
+        bc->data = malloc((size_t) nbuf * blocksz);
+    if (bc->bufs == NULL || (!mapped && bc->data == NULL)) {
+        bcache_destroy(f);
+        return 0;
+    }
+
+    /* per shard: metadata buffers, data buffers, then their ghosts */
+    b = bc->bufs;
+    k = 0;
+    for (s = 0; s < nshard; ++s) {
+        bshard * sh = &bc->shards[s];
+        int cls;
+        for (cls = BUF_META; cls >= BUF_DATA; --cls) {
+            bpart * p = &sh->part[cls];
+            for (i = 0; i < p->cap; ++i, ++b) {
+                b->cls = cls;
+                b->bid = -1;
+                if (!mapped)
+                    b->d = bc->data + (size_t) k++ * blocksz;
+                q_push_front(&p->freeq, b);
+            }
+        }
+        for (cls = BUF_META; cls >= BUF_DATA; --cls) {
+            bpart * p = &sh->part[cls];
+            for (i = 0; i < p->kout; ++i, ++b) {
+                b->cls = cls;
+                b->bid = -1;
+                q_push_front(&p->ghosts, b);
+            }
+        }
+    }
+    bc->ntotal = ntotal;
+    return 1;
+}
+
+void bcache_destroy(fs * f) {
+    bcache * bc = &f->bc;
+    int s;
+    for (s = 0; bc->shards != NULL && s < bc->nshard; ++s) {
+        pthread_mutex_destroy(&bc->shards[s].lock);
+        free(bc->shards[s].hash);
+    }
+    free(bc->shards);
+    free(bc->bufs);
+    free(bc->data);
+    bc->shards = NULL;
+    bc->bufs = NULL;
+    bc->data = NULL;
+}
+
+int writeblk(fs * f, buffer * b) {
+    long t0 = trace_begin(f);
+    int ret = f->be->ops->write(f->be, ABSBLK(f, b->bid), b->d, 1);
+    trace_end(f, TR_WRITEBLK, t0, b->bid);
+    if (ret) {
+        stat_add(f, ST_WRITEBACK, 1);
+        stat_add(f, ST_BLK_WRITE, 1);
+        b->dirty = 0;
+        b->age = 0;
+        b->ckpt = 0;
+    }
+    return ret;
+}
+
+static void drop_ghost(bshard * sh, buffer * g) {
+    hash_remove(sh, g);
+    q_move_front(&sh->part[g->cls].ghosts, g);
+    g->bid = -1;
+}
+
+/* remember bid on a1out after its buffer left a1in */
+static void remember(bshard * sh, bpart * p, int bid) {
+    buffer * g;
+    if (p->ghosts.len == 0 || p->a1out.len >= p->kout)
+        drop_ghost(sh, p->a1out.head.prev);
+    g = p->ghosts.head.next;
+    g->bid = bid;
+    hash_insert(sh, g);
+    q_move_front(&p->a1out, g);
+}
+
+/* a free buffer of partition p of sh, or one evicted from it; NULL if none can go */
+static buffer * take(fs * f, bshard * sh, bpart * p) {
+    buffer * b = NULL;
+    int from_a1in;
+
+    if (p->freeq.len)
+        return p->freeq.head.next;
+
+    from_a1in = p->a1in.len > p->kin || p->am.len == 0;
+    if (from_a1in)
+        b = q_victim(f, &p->a1in);
+    if (b == NULL) {
+        b = q_victim(f, &p->am);
+        from_a1in = 0;
+    }
+    if (b == NULL) {
+        b = q_victim(f, &p->a1in);
+        from_a1in = 1;
+    }
+    if (b == NULL) return NULL;
+    if ((b->dirty || b->ckpt) && !writeblk(f, b)) return NULL;
+
+    stat_add(f, ST_EVICT, 1);
+    hash_remove(sh, b);
+    if (from_a1in)
+        remember(sh, p, b->bid);
+    b->bid = -1;
+    return b;
+}
+
+/*
+ * Find a buffer in partition p of sh that can be reused for another
+ * block. When every buffer of the metadata partition is pinned or holds
+ * uncommitted metadata, it grows by a buffer taken from the data
+ * partition, which gets it back before it evicts one of its own.
+ */
+static buffer * reclaim(fs * f, bshard * sh, bpart * p) {
+    bpart * meta = &sh->part[BUF_META], * data = &sh->part[BUF_DATA];
+    buffer * b;
+
+    if (p == data && meta->cap > meta->size && !data->freeq.len &&
+        (b = take(f, sh, meta)) != NULL) {
+        b->cls = BUF_DATA;
+        meta->cap--;
+        data->cap++;
+        return b;
+    }
+    if ((b = take(f, sh, p)) != NULL || p == data)
+        return b;
+    if ((b = take(f, sh, data)) != NULL) {
+        b->cls = BUF_META;
+        data->cap--;
+        meta->cap++;
+    }
+    return b;
+}
+
+/* the buffer of bid, read in on a miss only if read is set */
+static buffer * getbuf(fs * f, int bid, int cls, int read) {
+    bshard * sh;
+    bpart * p;
+    buffer * b;
+    bqueue * q;
+
+    if (bid < 0) return NULL;
+    if (f->be->base != NULL && (ABSBLK(f, bid) + 1) * blocksz > f->be->len)
+        return NULL;
+    sh = shard_of(&f->bc, bid);
+    p = &sh->part[cls];
+    pthread_mutex_lock(&sh->lock);
+    b = hash_find(sh, bid);
+    if (b != NULL && b->q != &sh->part[b->cls].a1out) {
+        /* a block reused under another class stays where it is */
+        bpart * bp = &sh->part[b->cls];
+        if (b->q == &bp->am)
+            q_move_front(&bp->am, b);
+        p->hits++;
+        __atomic_add_fetch(&b->pin, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sh->lock);
+        return b;
+    }
+
+    p->misses++;
+    q = &p->a1in;
+    if (b != NULL) {
+        if (b->cls == cls)
+            q = &p->am;
+        drop_ghost(sh, b);
+    }
+
+    b = reclaim(f, sh, p);
+    if (b != NULL) {
+        b->bid = bid;
+        if (f->be->base != NULL)
+            b->d = f->be->base + ABSBLK(f, bid) * blocksz;
+        else if (read) {
+            long t0 = trace_begin(f);
+            stat_add(f, ST_BLK_READ, 1);
+            if (!f->be->ops->read(f->be, ABSBLK(f, bid), b->d, 1))
+                memset(b->d, 0, blocksz);
+            trace_end(f, TR_BLK_READ, t0, bid);
+        }
+        hash_insert(sh, b);
+        q_move_front(q, b);
+        __atomic_add_fetch(&b->pin, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return b;
+}
+
+/*
+ * The buffer of block bid, read in if it is not cached. It comes back
+ * pinned and stays valid until brelse().
+ */
+buffer* openblk(fs * f, int bid, int cls) {
+    return getbuf(f, bid, cls, 1);
+}
+
+/*
+ * Like openblk(), but a block that is not cached is not read: the
+ * caller is about to overwrite all of it.
+ */
+buffer * getblk(fs * f, int bid, int cls) {
+    return getbuf(f, bid, cls, 0);
+}
+
+static int cmp_shard(const void * a, const void * b) {
+    bshard * x = *(bshard * const *) a, * y = *(bshard * const *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Read up to RA_MAX_BLOCKS blocks from bid on into the cache. Blocks
+ * already cached are left alone; the rest enter a1in unpinned and are
+ * read with one backend call per run of consecutive missing blocks. The
+ * shards of the range are locked in index order, as bcache_lock_all()
+ * does.
+ */
+static int readahead_some(fs * f, int bid, int n, int cls) {
+    bcache * bc = &f->bc;
+    bshard * shs[RA_MAX_BLOCKS / SHARD_SPAN + 2];
+    buffer * v[RA_MAX_BLOCKS];
+    char * bufs[RA_MAX_BLOCKS];
+    int i, j, k, nsh = 0, nv = 0;
+
+    if (n > RA_MAX_BLOCKS) n = RA_MAX_BLOCKS;
+    for (i = 0; i < n; ++i) {
+        bshard * sh = shard_of(bc, bid + i);
+        for (j = 0; j < nsh && shs[j] != sh; ++j)
+            ;
+        if (j == nsh) shs[nsh++] = sh;
+    }
+    qsort(shs, nsh, sizeof(bshard*), cmp_shard);
+    for (j = 0; j < nsh; ++j)
+        pthread_mutex_lock(&shs[j]->lock);
+
+    for (i = 0; i < n; ++i) {
+        bshard * sh = shard_of(bc, bid + i);
+        bpart * p = &sh->part[cls];
+        buffer * b = hash_find(sh, bid + i);
+        if (b != NULL) {
+            if (b->q != &sh->part[b->cls].a1out) continue;
+            drop_ghost(sh, b);
+        }
+        b = reclaim(f, sh, p);
+        if (b == NULL) break;
+        b->bid = bid + i;
+        hash_insert(sh, b);
+        q_move_front(&p->a1in, b);
+        /* pinned so that the blocks after it cannot push it out */
+        __atomic_add_fetch(&b->pin, 1, __ATOMIC_RELAXED);
+        v[nv++] = b;
+    }
+
+    for (i = 0; i < nv; i = j) {
+        long t0 = trace_begin(f);
+        for (j = i + 1; j < nv && v[j]->bid == v[j - 1]->bid + 1; ++j)
+            ;
+        for (k = i; k < j; ++k)
+            bufs[k - i] = v[k]->d;
+        stat_add(f, ST_BLK_READ, j - i);
+        stat_add(f, ST_READAHEAD, j - i);
+        if (!f->be->ops->readv(f->be, ABSBLK(f, v[i]->bid), bufs, j - i))
+            for (k = i; k < j; ++k)
+                memset(v[k]->d, 0, blocksz);
+        trace_end(f, TR_READAHEAD, t0, j - i);
+    }
+    for (i = 0; i < nv; ++i)
+        brelse(f, v[i]);
+
+    for (j = nsh - 1; j >= 0; --j)
+        pthread_mutex_unlock(&shs[j]->lock);
+    return nv;
+}
+
+/*
+ * Bring blocks bid .. bid + n - 1 into the cache ahead of use. Nothing
+ * is done on a mapped image, whose blocks are used in place. Returns the
+ * number of blocks read.
+ */
+int bcache_readahead(fs * f, int bid, int n, int cls) {
+    int k, got = 0;
+    if (f->be->base != NULL || bid < 0) return 0;
+    for (; n > 0; bid += k, n -= k) {
+        k = n < RA_MAX_BLOCKS ? n : RA_MAX_BLOCKS;
+        got += readahead_some(f, bid, k, cls);
+    }
+    return got;
+}
+
+/*
+ * Unpin a buffer from openblk(); b may be NULL. Pins are only taken
+ * under the shard lock, so dropping one needs no lock: a victim scan
+ * either still sees the pin or sees everything done before it was
+ * dropped.
+ */
+void brelse(fs * f, buffer * b) {
+    (void) f;
+    if (b != NULL)
+        __atomic_sub_fetch(&b->pin, 1, __ATOMIC_RELEASE);
+}
+
+void bcache_lock_all(fs * f) {
+    int s;
+    for (s = 0; s < f->bc.nshard; ++s)
+        pthread_mutex_lock(&f->bc.shards[s].lock);
+}
+
+void bcache_unlock_all(fs * f) {
+    int s;
+    for (s = f->bc.nshard - 1; s >= 0; --s)
+        pthread_mutex_unlock(&f->bc.shards[s].lock);
+}
+
+static int cmp_bid(const void * a, const void * b) {
+    int x = (*(buffer * const *) a)->bid, y = (*(buffer * const *) b)->bid;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Write back the n dirty buffers in v. They are sorted by block id and
+ * every run of consecutive blocks goes to the backend as one write.
+ */
+static int write_sorted(fs * f, buffer ** v, int n) {
+    char ** bufs;
+    int i, j, k;
+    int ret = 1;
+
+    if (n == 0) return 1;
+    bufs = malloc(n * sizeof(char*));
+    if (bufs == NULL) {
+        for (i = 0; i < n; ++i)
+            if (!writeblk(f, v[i])) ret = 0;
+        return ret;
+    }
+    qsort(v, n, sizeof(buffer*), cmp_bid);
+    for (i = 0; i < n; i = j) {
+        long t0 = trace_begin(f);
+        int ok;
+        for (j = i + 1; j < n && v[j]->bid == v[j - 1]->bid + 1; ++j)
+            ;
+        for (k = i; k < j; ++k)
+            bufs[k - i] = v[k]->d;
+        ok = f->be->ops->writev(f->be, ABSBLK(f, v[i]->bid), bufs, j - i);
+        trace_end(f, TR_WRITEBACK, t0, j - i);
+        if (!ok) {
+            ret = 0;
+            continue;
+        }
+        stat_add(f, ST_WRITEBACK, j - i);
+        stat_add(f, ST_BLK_WRITE, j - i);
+        for (k = i; k < j; ++k) {
+            v[k]->dirty = 0;
+            v[k]->age = 0;
+            v[k]->ckpt = 0;
+        }
+    }
+    free(bufs);
+    return ret;
+}
+
+/* may b be written to its home block now? */
+static int home_ok(fs * f, buffer * b) {
+    return !(f->jnl.on && b->cls == BUF_META);
+}
+
+/*
+ * Write back the dirty buffers of class cls, or of both if cls < 0.
+ * Metadata is left to the journal when there is one. All shards are
+ * locked by the caller.
+ */
+static int flush_locked(fs * f, int cls) {
+    bcache * bc = &f->bc;
+    buffer ** v = malloc(bc->nbuf * sizeof(buffer*));
+    int i, n = 0;
+    int ret;
+
+    if (v == NULL) {
+        ret = 1;
+        for (i = 0; i < bc->ntotal; ++i) {
+            buffer * b = &bc->bufs[i];
+            if (b->dirty && (cls < 0 || b->cls == cls) && home_ok(f, b) &&
+                !writeblk(f, b))
+                ret = 0;
+        }
+        return ret;
+    }
+    for (i = 0; i < bc->ntotal; ++i) {
+        buffer * b = &bc->bufs[i];
+        if (b->dirty && (cls < 0 || b->cls == cls) && home_ok(f, b))
+            v[n++] = b;
+    }
+    ret = write_sorted(f, v, n);
+    free(v);
+    return ret;
+}
+
+static int flush_some(fs * f, int cls) {
+    int ret;
+    bcache_lock_all(f);
+    ret = flush_locked(f, cls);
+    bcache_unlock_all(f);
+    return ret;
+}
+
+int bcache_flush(fs * f) {
+    return flush_some(f, -1);
+}
+
+/* write bid back if it is cached dirty */
+int bcache_flush_blk(fs * f, int bid) {
+    bshard * sh = shard_of(&f->bc, bid);
+    buffer * b;
+    int ret = 1;
+    pthread_mutex_lock(&sh->lock);
+    b = hash_find(sh, bid);
+    if (b != NULL && b->dirty)
+        ret = writeblk(f, b);
+    pthread_mutex_unlock(&sh->lock);
+    return ret;
+}
+
+/* write back every dirty buffer of class cls */
+int bcache_flush_cls(fs * f, int cls) {
+    return flush_some(f, cls);
+}
+
+/*
+ * One pass of background write-back: age the dirty buffers and write
+ * those that have been dirty for expire passes. If more than ratio
+ * percent of the cache is still dirty afterwards, write it all.
+ */
+int bcache_writeback(fs * f, int expire, int ratio) {
+    bcache * bc = &f->bc;
+    buffer ** v = malloc(bc->nbuf * sizeof(buffer*));
+    int i, n = 0, ndirty = 0;
+    int ret = 1;
+
+    if (v == NULL) return bcache_flush(f);
+    bcache_lock_all(f);
+    for (i = 0; i < bc->ntotal; ++i) {
+        buffer * b = &bc->bufs[i];
+        if (!b->dirty || !home_ok(f, b)) continue;
+        if (++b->age >= expire)
+            v[n++] = b;
+        else
+            ++ndirty;
+    }
+    ret = write_sorted(f, v, n);
+    free(v);
+    if (ndirty * 100 > bc->nbuf * ratio && !flush_locked(f, -1))
+        ret = 0;
+    bcache_unlock_all(f);
+    return ret;
+}
+
+/*
+ * The largest share, in percent, of dirty buffers in a metadata
+ * partition; *total is set to their number in all partitions.
+ */
+int bcache_meta_dirty(fs * f, int * total) {
+    int s, max = 0;
+    *total = 0;
+    for (s = 0; s < f->bc.nshard; ++s) {
+        bshard * sh = &f->bc.shards[s];
+        bpart * p = &sh->part[BUF_META];
+        bqueue * qs[2];
+        int i, n = 0, cap;
+        buffer * b;
+        qs[0] = &p->a1in;
+        qs[1] = &p->am;
+        pthread_mutex_lock(&sh->lock);
+        /* a pinned buffer may be changing under its owner; skip it */
+        for (i = 0; i < 2; ++i)
+            for (b = qs[i]->head.next; b != &qs[i]->head; b = b->next)
+                if (!__atomic_load_n(&b->pin, __ATOMIC_ACQUIRE))
+                    n += b->dirty;
+        cap = p->cap;
+        pthread_mutex_unlock(&sh->lock);
+        *total += n;
+        if (n * 100 / cap > max)
+            max = n * 100 / cap;
+    }
+    return max;
+}
+
+void fs_cachestat(fs * f, fs_cachestats * st) {
+    int s;
+    memset(st, 0, sizeof(*st));
+    for (s = 0; s < f->bc.nshard; ++s) {
+        bshard * sh = &f->bc.shards[s];
+        pthread_mutex_lock(&sh->lock);
+        st->meta_hits += sh->part[BUF_META].hits;
+        st->meta_misses += sh->part[BUF_META].misses;
+        st->data_hits += sh->part[BUF_DATA].hits;
+        st->data_misses += sh->part[BUF_DATA].misses;
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
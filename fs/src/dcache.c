@@ -0,0 +1,154 @@
+#include "fs_impl.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Dentry cache: remembers the result of looking up a name in a directory,
+ * keyed by (parent inode, name). A negative entry (ino == -1) records
+ * that the name does not exist. Entries are kept in LRU order in a fixed
+ * pool; fs.c keeps them in step with add_entry() and remove_entry().
+ * Lookups run under a shared namespace lock, so the cache has a lock of
+ * its own.
+ */
+
+unsigned int name_hash(const char * s) {
+    unsigned int h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static unsigned int dc_hash(dcache * dc, int parent, unsigned int nh) {
+    return (nh ^ ((unsigned int) parent * 2654435761u)) & (dc->nhash - 1);
+}
+
+static void dc_unlink(dcentry * e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void dc_push_front(dcache * dc, dcentry * e) {
+    e->next = dc->lru.next;
+    e->prev = &dc->lru;
+    dc->lru.next->prev = e;
+    dc->lru.next = e;
+}
+
+static void dc_hash_remove(dcache * dc, dcentry * e) {
+    dcentry ** pp = &dc->hash[dc_hash(dc, e->parent, e->hash)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->parent = -1;
+}
+
+static dcentry * dc_find(dcache * dc, int parent, const char * name, unsigned int nh) {
+    dcentry * e;
+    for (e = dc->hash[dc_hash(dc, parent, nh)]; e != NULL; e = e->hnext)
+        if (e->parent == parent && e->hash == nh && strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+int dcache_init(fs * f, int n) {
+    dcache * dc = &f->dc;
+    int i;
+
+    for (dc->nhash = 1; dc->nhash < n; dc->nhash <<= 1)
+        ;
+    dc->n = n;
+    dc->ents = calloc(n, sizeof(dcentry));
+    dc->hash = calloc(dc->nhash, sizeof(dcentry*));
+    if (dc->ents == NULL || dc->hash == NULL) {
+        dcache_destroy(f);
+        return 0;
+    }
+    dc->lru.next = dc->lru.prev = &dc->lru;
+    for (i = 0; i < n; ++i) {
+        dc->ents[i].parent = -1;
+        dc_push_front(dc, &dc->ents[i]);
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+    return 1;
+}
+
+void dcache_destroy(fs * f) {
+    if (f->dc.ents != NULL && f->dc.hash != NULL)
+        pthread_mutex_destroy(&f->dc.lock);
+    free(f->dc.ents);
+    free(f->dc.hash);
+    f->dc.ents = NULL;
+    f->dc.hash = NULL;
+}
+
+/*
+ * Returns 1 and fills *ino and *pos if (parent, name) is cached; *ino
+ * is -1 for a name known not to exist.
+ */
+int dcache_lookup(fs * f, int parent, const char * name, int * ino, int * pos) {
+    dcache * dc = &f->dc;
+    dcentry * e;
+    pthread_mutex_lock(&dc->lock);
+    e = dc_find(dc, parent, name, name_hash(name));
+    if (e != NULL) {
+        dc_unlink(e);
+        dc_push_front(dc, e);
+        *ino = e->ino;
+        *pos = e->pos;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return e != NULL;
+}
+
+void dcache_enter(fs * f, int parent, const char * name, int ino, int pos) {
+    dcache * dc = &f->dc;
+    unsigned int nh = name_hash(name);
+    dcentry * e;
+
+    pthread_mutex_lock(&dc->lock);
+    e = dc_find(dc, parent, name, nh);
+    if (e == NULL) {
+        e = dc->lru.prev;
+        if (e->parent != -1)
+            dc_hash_remove(dc, e);
+        e->parent = parent;
+        e->hash = nh;
+        strncpy(e->name, name, MAX_FNAME_LEN - 1);
+        e->name[MAX_FNAME_LEN - 1] = '\0';
+        e->hnext = dc->hash[dc_hash(dc, parent, nh)];
+        dc->hash[dc_hash(dc, parent, nh)] = e;
+    }
+    e->ino = ino;
+    e->pos = pos;
+    dc_unlink(e);
+    dc_push_front(dc, e);
+    pthread_mutex_unlock(&dc->lock);
+}
+
+/* a cached dentry was moved to index pos of its directory */
+void dcache_move(fs * f, int parent, const char * name, int pos) {
+    dcentry * e;
+    pthread_mutex_lock(&f->dc.lock);
+    e = dc_find(&f->dc, parent, name, name_hash(name));
+    if (e != NULL && e->ino != -1)
+        e->pos = pos;
+    pthread_mutex_unlock(&f->dc.lock);
+}
+
+/* forget everything cached under directory parent */
+void dcache_purge(fs * f, int parent) {
+    dcache * dc = &f->dc;
+    int i;
+    pthread_mutex_lock(&dc->lock);
+    for (i = 0; i < dc->n; ++i)
+        if (dc->ents[i].parent == parent) {
+            dcentry * e = &dc->ents[i];
+            dc_hash_remove(dc, e);
+            dc_unlink(e);
+            e->next = &dc->lru;
+            e->prev = dc->lru.prev;
+            dc->lru.prev->next = e;
+            dc->lru.prev = e;
+        }
+    pthread_mutex_unlock(&dc->lock);
+}
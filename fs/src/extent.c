@@ -0,0 +1,292 @@
+#include "fs_impl.h"
+#include <string.h>
+#include <limits.h>
+
+/*
+ * Extent mapping for inodes with I_EXTENT set.
+ *
+ * block_id[] of such an inode is the root node of an extent tree. A
+ * node is an exthdr followed by records: leaves (depth 0) hold extents
+ * mapping len logical blocks starting at lblk to physical blocks
+ * starting at pblk, index nodes hold the first lblk and the block of
+ * each child. The root has room for 2 extents or 3 index entries, a
+ * block-sized node for 341 extents or 511 index entries. Records are
+ * sorted by lblk. Nodes are split top-down on insertion, so a full root
+ * is pushed into a new block and the tree grows by one level.
+ *
+ * A file written sequentially gets its blocks in contiguous runs from
+ * alloc_run() and maps with a single extent held in the inode itself.
+ */
+
+typedef struct exthdr_ {
+    unsigned short entries;
+    unsigned short depth;
+} exthdr;
+
+typedef struct ext_ {
+    int lblk;
+    int pblk;
+    int len;
+} ext;
+
+typedef struct exti_ {
+    int lblk;
+    int pblk;
+} exti;
+
+#define EXT_MAX_DEPTH 8
+#define HDR(n) ((exthdr*) (n))
+#define LEAF(n) ((ext*) ((char*) (n) + sizeof(exthdr)))
+#define IDX(n) ((exti*) ((char*) (n) + sizeof(exthdr)))
+
+static int node_cap(int in_inode, int depth) {
+    int room = (in_inode ? (int) sizeof(((inode*) 0)->block_id) : blocksz) - sizeof(exthdr);
+    return room / (depth ? sizeof(exti) : sizeof(ext));
+}
+
+/* last index entry whose lblk <= bn, or 0 */
+static int idx_search(char * node, int bn) {
+    exti * ix = IDX(node);
+    int lo = 1, hi = HDR(node)->entries - 1, ret = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ix[mid].lblk <= bn) {
+            ret = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return ret;
+}
+
+/* last extent whose lblk <= bn, or -1 */
+static int leaf_search(char * node, int bn) {
+    ext * ex = LEAF(node);
+    int lo = 0, hi = HDR(node)->entries - 1, ret = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ex[mid].lblk <= bn) {
+            ret = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
+    }
+    return ret;
+}
+
+/*
+ * Descend to the leaf that covers bn. Returns the leaf node and sets *bp
+ * to its buffer (NULL for the inode root), which the caller releases, or
+ * returns NULL on I/O failure. If limit is given it receives the first
+ * lblk above bn that belongs to a later leaf, or INT_MAX.
+ */
+static char * find_leaf(fs * f, int ip, int bn, buffer ** bp, int * limit) {
+    char * node = (char*) iget(f, ip)->block_id;
+    *bp = NULL;
+    if (limit) *limit = INT_MAX;
+    while (HDR(node)->depth > 0) {
+        int i = idx_search(node, bn);
+        buffer * b;
+        if (limit && i + 1 < HDR(node)->entries && IDX(node)[i + 1].lblk < *limit)
+            *limit = IDX(node)[i + 1].lblk;
+        stat_add(f, ST_MAP_LOAD, 1);
+        b = openblk(f, IDX(node)[i].pblk, BUF_META);
+        brelse(f, *bp);
+        *bp = b;
+        if (b == NULL) return NULL;
+        node = b->d;
+    }
+    return node;
+}
+
+/* make room in the root by moving its records into a new child block */
+static int grow_root(fs * f, int ip) {
+    char * root = (char*) iget(f, ip)->block_id;
+    int nb = alloc_run(f, ino_goal(f, ip), 1, NULL);
+    buffer * b = getblk(f, nb, BUF_META);
+    exthdr * h = HDR(root);
+    int rsz;
+
+    if (b == NULL) {
+        if (nb >= 0) free_blk(f, nb);
+        return 0;
+    }
+    rsz = h->depth ? sizeof(exti) : sizeof(ext);
+    memset(b->d, 0, blocksz);
+    memcpy(b->d, root, sizeof(exthdr) + h->entries * rsz);
+    b->dirty = 1;
+    brelse(f, b);
+
+    IDX(root)[0].lblk = h->entries ? (h->depth ? IDX(root)[0].lblk : LEAF(root)[0].lblk) : 0;
+    IDX(root)[0].pblk = nb;
+    h->entries = 1;
+    h->depth++;
+    return 1;
+}
+
+/*
+ * Split the full child at index i of parent into two blocks. The child
+ * is pinned by the caller.
+ */
+static int split_child(fs * f, int ip, char * parent, int i, buffer * child) {
+    exthdr * ch = HDR(child->d);
+    int rsz = ch->depth ? sizeof(exti) : sizeof(ext);
+    int keep = ch->entries / 2;
+    int move = ch->entries - keep;
+    int nb = alloc_run(f, ino_goal(f, ip), 1, NULL);
+    buffer * sb = getblk(f, nb, BUF_META);
+    exti * ix = IDX(parent);
+
+    if (sb == NULL) {
+        if (nb >= 0) free_blk(f, nb);
+        return 0;
+    }
+    memset(sb->d, 0, blocksz);
+    HDR(sb->d)->depth = ch->depth;
+    HDR(sb->d)->entries = move;
+    memcpy(sb->d + sizeof(exthdr), child->d + sizeof(exthdr) + keep * rsz, move * rsz);
+    ch->entries = keep;
+    sb->dirty = 1;
+    child->dirty = 1;
+    brelse(f, sb);
+
+    memmove(&ix[i + 2], &ix[i + 1], (HDR(parent)->entries - i - 1) * sizeof(exti));
+    ix[i + 1].lblk = ch->depth ? IDX(sb->d)[0].lblk : LEAF(sb->d)[0].lblk;
+    ix[i + 1].pblk = nb;
+    HDR(parent)->entries++;
+    return 1;
+}
+
+/* insert extent r; the tree has no extent overlapping it */
+static int ext_insert(fs * f, int ip, ext r) {
+    char * node = (char*) iget(f, ip)->block_id;
+    buffer * nbuf = NULL;
+    ext * ex;
+    int i;
+
+    if (HDR(node)->entries >= node_cap(1, HDR(node)->depth)) {
+        if (HDR(node)->depth + 1 >= EXT_MAX_DEPTH || !grow_root(f, ip))
+            return 0;
+    }
+
+    while (HDR(node)->depth > 0) {
+        buffer * cb;
+        i = idx_search(node, r.lblk);
+        cb = openblk(f, IDX(node)[i].pblk, BUF_META);
+        if (cb == NULL) goto fail;
+        if (HDR(cb->d)->entries >= node_cap(0, HDR(cb->d)->depth)) {
+            int ok = split_child(f, ip, node, i, cb);
+            brelse(f, cb);
+            if (!ok) goto fail;
+            if (nbuf) nbuf->dirty = 1;
+            i = idx_search(node, r.lblk);
+            cb = openblk(f, IDX(node)[i].pblk, BUF_META);
+            if (cb == NULL) goto fail;
+        }
+        brelse(f, nbuf);
+        nbuf = cb;
+        node = cb->d;
+    }
+
+    ex = LEAF(node);
+    i = leaf_search(node, r.lblk) + 1;
+    memmove(&ex[i + 1], &ex[i], (HDR(node)->entries - i) * sizeof(ext));
+    ex[i] = r;
+    HDR(node)->entries++;
+    if (nbuf) nbuf->dirty = 1;
+    brelse(f, nbuf);
+    return 1;
+
+fail:
+    brelse(f, nbuf);
+    return 0;
+}
+
+/*
+ * Map logical block bn of extent inode ip. With alloc > 0 a missing
+ * block is allocated together with up to alloc - 1 following ones that
+ * are also unmapped, as one contiguous run placed right after the
+ * preceding extent when possible. *run, if given, receives the number of
+ * blocks from bn on that are mapped contiguously, and *fresh whether
+ * they were allocated by this call. Returns -1 for a hole or on failure.
+ */
+int ext_map(fs * f, int ip, int bn, int alloc, int * run, int * fresh) {
+    buffer * b;
+    char * leaf;
+    ext * e = NULL;
+    ext r;
+    int i, pb, got, limit, goal = -1;
+
+    if (run) *run = 1;
+    if (fresh) *fresh = 0;
+    leaf = find_leaf(f, ip, bn, &b, &limit);
+    if (leaf == NULL) return -1;
+    i = leaf_search(leaf, bn);
+    if (i >= 0) {
+        e = &LEAF(leaf)[i];
+        if (bn < e->lblk + e->len) {
+            pb = e->pblk + (bn - e->lblk);
+            if (run) *run = e->lblk + e->len - bn;
+            brelse(f, b);
+            return pb;
+        }
+        goal = e->pblk + (bn - e->lblk);
+    }
+    if (alloc <= 0) {
+        brelse(f, b);
+        return -1;
+    }
+    if (goal < 0) goal = ino_goal(f, ip);
+
+    if (i + 1 < HDR(leaf)->entries)
+        limit = LEAF(leaf)[i + 1].lblk;
+    if (alloc > limit - bn) alloc = limit - bn;
+    /* the leaf stays pinned while allocating */
+    if ((pb = alloc_run(f, goal, alloc, &got)) < 0) {
+        brelse(f, b);
+        return -1;
+    }
+    if (run) *run = got;
+    if (fresh) *fresh = 1;
+    if (e && e->lblk + e->len == bn && e->pblk + e->len == pb) {
+        e->len += got;
+        if (b) b->dirty = 1;
+        brelse(f, b);
+        return pb;
+    }
+    brelse(f, b);
+    r.lblk = bn;
+    r.pblk = pb;
+    r.len = got;
+    if (!ext_insert(f, ip, r)) {
+        free_run(f, pb, got);
+        return -1;
+    }
+    return pb;
+}
+
+static void release_node(fs * f, char * node) {
+    int i;
+    if (HDR(node)->depth == 0) {
+        ext * ex = LEAF(node);
+        for (i = 0; i < HDR(node)->entries; ++i)
+            free_run(f, ex[i].pblk, ex[i].len);
+        return;
+    }
+    for (i = 0; i < HDR(node)->entries; ++i) {
+        int cb = IDX(node)[i].pblk;
+        buffer * b = openblk(f, cb, BUF_META);
+        if (b != NULL) {
+            release_node(f, b->d);
+            brelse(f, b);
+        }
+        free_blk(f, cb);
+    }
+}
+
+/* free every block of extent inode ip, including the tree itself */
+void ext_release(fs * f, int ip) {
+    release_node(f, (char*) iget(f, ip)->block_id);
+}
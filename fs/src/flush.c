@@ -0,0 +1,84 @@
+#include "fs_impl.h"
+#include <time.h>
+#include <errno.h>
+
+/*
+ * Background write-back. When fs_opts.flush_interval is set, a thread
+ * wakes up every interval and, holding oplock exclusively, writes back
+ * the buffers that have been dirty for longer than dirty_expire, or all
+ * of them once more than dirty_ratio percent of the cache is dirty. The
+ * superblock and the inode table are written once per dirty_expire, so
+ * at most that much work is lost in a crash. With a journal every pass
+ * commits instead, which makes the interval the group commit period.
+ */
+
+static void * flusher(void * arg) {
+    fs * f = arg;
+    flushctl * fl = &f->fl;
+    struct timespec ts;
+
+    pthread_mutex_lock(&fl->mu);
+    while (!fl->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += fl->interval / 1000;
+        ts.tv_nsec += (long) (fl->interval % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (!fl->stop &&
+               pthread_cond_timedwait(&fl->cv, &fl->mu, &ts) != ETIMEDOUT)
+            ;
+        if (fl->stop) break;
+        pthread_mutex_unlock(&fl->mu);
+
+        pthread_rwlock_wrlock(&f->oplock);
+        bcache_writeback(f, fl->expire, fl->ratio);
+        if (f->jnl.on)
+            jnl_commit(f);
+        else if (++fl->passes >= fl->expire) {
+            write_super(f);
+            fl->passes = 0;
+        }
+        f->be->ops->flush(f->be);
+        pthread_rwlock_unlock(&f->oplock);
+        pthread_mutex_lock(&fl->mu);
+    }
+    pthread_mutex_unlock(&fl->mu);
+    return NULL;
+}
+
+int flusher_start(fs * f, const fs_opts * opts) {
+    flushctl * fl = &f->fl;
+    int expire;
+
+    if (opts == NULL || opts->flush_interval <= 0) return 1;
+    fl->interval = opts->flush_interval;
+    expire = opts->dirty_expire > 0 ? opts->dirty_expire : DIRTY_EXPIRE;
+    fl->expire = (expire + fl->interval - 1) / fl->interval;
+    fl->ratio = opts->dirty_ratio > 0 ? opts->dirty_ratio : DIRTY_RATIO;
+    fl->stop = 0;
+    fl->passes = 0;
+    if (pthread_cond_init(&fl->cv, NULL) != 0) return 0;
+    pthread_mutex_init(&fl->mu, NULL);
+    if (pthread_create(&fl->thread, NULL, flusher, f) != 0) {
+        pthread_cond_destroy(&fl->cv);
+        pthread_mutex_destroy(&fl->mu);
+        return 0;
+    }
+    fl->on = 1;
+    return 1;
+}
+
+void flusher_stop(fs * f) {
+    flushctl * fl = &f->fl;
+    if (!fl->on) return;
+    pthread_mutex_lock(&fl->mu);
+    fl->stop = 1;
+    pthread_cond_signal(&fl->cv);
+    pthread_mutex_unlock(&fl->mu);
+    pthread_join(fl->thread, NULL);
+    pthread_cond_destroy(&fl->cv);
+    pthread_mutex_destroy(&fl->mu);
+    fl->on = 0;
+}
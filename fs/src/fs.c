@@ -1,57 +1,16 @@
-#include "../include/fs.h"
+#define _GNU_SOURCE         /* pthread_rwlockattr_setkind_np */
+#include "fs_impl.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
-#define MAX_FD 256
-
 static const char magic[] = "\0221\012";
-#define blocksz 4096
-#define inodect (blocksz/64)
-#define FREE_BLOCK_NUM 500
-#define MAX_PATH_LEN 252
-#define MAX_FNAME_LEN 124
-#define MAX_FILE_SIZE (8*blocksz/sizeof(int)*blocksz)
-
-typedef struct superblock_ {
-    char magic_number[4];
-    int block_offset;
-    int inode_cnt;
-    int block_cnt;
-    int total_free_block_num;
-    int free_blocks[FREE_BLOCK_NUM];
-    int free_inode;
-} superblock;
-
-typedef struct fdesc_ {
-    int inodeid;
-    int mode;
-    int used;
-    unsigned int offset;
-} fdesc;
-
-typedef struct buffer {
-    int dirty; 
-    int free;
-    int bid;
-    char d[blocksz];
-} buffer;
-
-struct fs_ {
-    int errno_;
-    superblock sb;
-    inode * inodes;
-    fdesc fds[MAX_FD];
-    FILE * fp;
-    buffer buf[16];
-    char cdir[MAX_PATH_LEN * 2];
-    int dno;
-};
 
 struct fs_dir_ {
     fs * f;
     int inode;
     int cur_off;
+    int id;             /* names the directory in recorded logs */
 };
 
 typedef struct dentry {
@@ -59,91 +18,69 @@ typedef struct dentry {
     int inode;
 } dentry;
 
-static int openi(fs*, const char*, int);
+/*
+ * Directories with at least DIRIDX_MIN entries get a hash index kept in
+ * a hidden inode (mode I_DIRIDX) whose number is stored in the
+ * directory's next_id, which is otherwise only used by free inodes. The
+ * dentry array itself is left as it was, so fs_nextent() and images
+ * written without an index keep working.
+ *
+ * The index file is a diridx_hdr followed by nslot open-addressed slots.
+ */
+#define DIRIDX_MIN 64
+#define DIRIDX_MAGIC 0x78646964
+
+typedef struct diridx_hdr_ {
+    int magic;
+    int nslot;          /* power of two */
+    int used;
+    int tombs;
+} diridx_hdr;
 
-static int writeblk(fs * f, int bid) {
-    int ret;
-    fseek(f->fp, f->sb.block_offset + f->buf[bid].bid * blocksz, SEEK_SET);
-    ret = fwrite(f->buf[bid].d, blocksz, 1, f->fp);
-//    printf("%d %d\n", bid, ret);
-    return ret;
-}
+typedef struct diridx_slot_ {
+    unsigned int hash;
+    int pos;            /* dentry index + 1, 0 if empty, -1 if deleted */
+} diridx_slot;
 
-static buffer* openblk(fs * f, int bid) {
-    int i;
-    int k;
-    for (i = 0; i < 16; ++i)
-        if (f->buf[i].bid == bid)
-            return &f->buf[i];
-    k = -1;
-    for (i = 0; i < 16; ++i)
-        if (f->buf[i].free) {
-            k = i;
-            break;
-        }
-    if (f->buf[k].dirty) {
-        if (!writeblk(f, k)) {
-            return NULL;
-        }
-        f->buf[k].dirty = 0;
-    }
-    f->buf[k].bid = bid;
-    fseek(f->fp, f->sb.block_offset + bid * blocksz, SEEK_SET);
-    fread(f->buf[k].d, blocksz , 1, f->fp);
-    return &f->buf[k];
-}
+#define IDX_SLOT_OFF(i) (sizeof(diridx_hdr) + (i) * sizeof(diridx_slot))
 
-static int alloc_blk(fs *f){
-    int ret = -1;
-    if (f->sb.total_free_block_num  == 0) return -1;
-    -- f->sb.block_cnt;
-    ret = f->sb.free_blocks[f->sb.block_cnt];
-    if (f->sb.block_cnt == 0) {
-        buffer *b = openblk(f, ret);
-        if (b == NULL) {
-            ++f->sb.block_cnt;
-            return -1;
-        }
-        memcpy(f->sb.free_blocks, b->d, sizeof(f->sb.free_blocks));
-        f->sb.block_cnt = FREE_BLOCK_NUM;
-    }
-    -- f->sb.total_free_block_num;
-    return ret;
-}
+/* result of resolve() */
+typedef struct lookup_ {
+    int parent;         /* directory holding the last component */
+    int ino;            /* inode the path names, -1 if it does not exist */
+    int pos;            /* dentry index of the last component in parent */
+    char name[MAX_FNAME_LEN];
+} lookup;
 
-static int free_blk(fs * f, int bid) {
-    if (f->sb.block_cnt == FREE_BLOCK_NUM) {
-        buffer * b = openblk(f, bid);
-        if (b == NULL) {
-            return 0;
-        }
-        memcpy(b->d, f->sb.free_blocks, sizeof(f->sb.free_blocks));
-        b->dirty = 1;
-        f->sb.block_cnt = 1;
-        f->sb.free_blocks[0] = bid;
-    }
-    else {
-        f->sb.free_blocks[f->sb.block_cnt++] = bid;
-    }
-    ++ f->sb.total_free_block_num;        
-    return 1;
+static int readi(fs *f, int ip, unsigned int off, void* ptr, int size);
+static int writei(fs *f, int ip, unsigned int off, const void* ptr, int size);
+
+#define ILOCK(f, ino) (&(f)->ilock[(ino) % ILOCKS])
+
+/* blocks taken by a table of n inodes */
+static long itbl_blocks(int n) {
+    return (sizeof(inode) * (long) n + blocksz - 1) / blocksz;
 }
 
 static void release_inode_blk(fs * f, int ino) {
     int i;
     inode * in;
-    in= &f->inodes[ino];
-    if (in->mode & 2) {
+    in= iget(f, ino);
+    /* whatever a descriptor remembers of the map is stale now */
+    __atomic_add_fetch(&f->map_gen, 1, __ATOMIC_RELEASE);
+    if (in->mode & I_EXTENT)
+        ext_release(f, ino);
+    else if (in->mode & 2) {
         for (i = 0; i < 8; ++i)
             if (in->block_id[i] > 0) {
-                buffer * b = openblk(f, in->block_id[i]);
-                b->free = 0;
+                buffer * b = openblk(f, in->block_id[i], BUF_META);
+                if (b == NULL) continue;
                 int * begin = (int*) b->d;
                 int * end = (int*) (b->d + blocksz);
                 for (; begin < end; ++begin)
                     if (*begin > 0)
                         free_blk(f, *begin);
-                b->free = 1;
+                brelse(f, b);
                 free_blk(f, in->block_id[i]);
             }
     }
@@ -154,20 +91,104 @@ static void release_inode_blk(fs * f, int ino) {
     }
 }
 
-static int creatfile(fs * f, const char * fname) {
-    return openi(f, fname, 1);
+static void free_inode(fs * f, int ino) {
+    inode * in = iget(f, ino);
+    int dir = in->mode & I_DIR;
+    if (dir)
+        dcache_purge(f, ino);
+    if (dir && (in->mode & I_INDEXED))
+        free_inode(f, in->next_id);
+    release_inode_blk(f, ino);
+    memset(in, 0, sizeof(inode));
+    idirty(f, ino);
+    ifree(f, ino, dir);
 }
 
-static fs * new_fs() {
-    fs * f = malloc( sizeof (*f) );
+/* drop the contents of a regular file */
+static void truncate_inode(fs * f, int ino) {
+    inode * in = iget(f, ino);
+    release_inode_blk(f, ino);
+    memset(in->block_id, 0, sizeof(in->block_id));
+    if (in->mode & I_INDIRECT)
+        in->mode &= ~I_INDIRECT;
+    in->size = 0;
+    idirty(f, ino);
+}
+
+static int backend_kind(const fs_opts * opts) {
+    int kind;
+    if (opts == NULL) return FS_BK_STDIO;
+    kind = (opts->flags & FS_OPT_MMAP) ? FS_BK_MMAP : opts->backend;
+    /* the journal relies on blocks reaching the image only when written */
+    if (kind == FS_BK_MMAP && (opts->flags & FS_OPT_JOURNAL))
+        kind = FS_BK_PIO;
+    return kind;
+}
+
+static void init_locks(fs * f) {
+    pthread_rwlockattr_t a;
+    int i;
+    pthread_rwlockattr_init(&a);
+#ifdef __GLIBC__
+    /* let commits and the flusher in while operations keep coming */
+    pthread_rwlockattr_setkind_np(&a, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&f->oplock, &a);
+    pthread_rwlockattr_destroy(&a);
+    pthread_rwlock_init(&f->nslock, NULL);
+    for (i = 0; i < ILOCKS; ++i)
+        pthread_rwlock_init(&f->ilock[i], NULL);
+    pthread_mutex_init(&f->alock, NULL);
+    pthread_rwlock_init(&f->fdlock, NULL);
+    pthread_mutex_init(&f->itbl_lock, NULL);
+}
+
+static void destroy_locks(fs * f) {
     int i;
+    pthread_rwlock_destroy(&f->oplock);
+    pthread_rwlock_destroy(&f->nslock);
+    for (i = 0; i < ILOCKS; ++i)
+        pthread_rwlock_destroy(&f->ilock[i]);
+    pthread_mutex_destroy(&f->alock);
+    pthread_rwlock_destroy(&f->fdlock);
+    pthread_mutex_destroy(&f->itbl_lock);
+}
+
+static fs * new_fs(const fs_opts * opts) {
+    fs * f = malloc( sizeof (*f) );
     if (f == NULL) return NULL;
+    f->inodes = NULL;
+    f->iloaded = NULL;
+    f->idirty = NULL;
+    f->be = NULL;
     memset(f->fds, 0, sizeof(f->fds));
+    f->map_gen = 0;
     f->errno_ = 0;
-    for (i = 0; i < 16; ++i) {
-        f->buf[i].dirty = 0;
-        f->buf[i].free = 1;
-        f->buf[i].bid = -1;
+    memset(&f->sb, 0, sizeof(f->sb));
+    memset(&f->fl, 0, sizeof(f->fl));
+    memset(&f->jnl, 0, sizeof(f->jnl));
+    memset(f->stats, 0, sizeof(f->stats));
+    init_locks(f);
+    trace_init(f);
+    rec_init(f);
+    aio_init(f, opts);
+    if (!bcache_init(f, opts ? opts->cache_size : 0,
+                     backend_kind(opts) == FS_BK_MMAP)) {
+        aio_destroy(f);
+        rec_destroy(f);
+        trace_destroy(f);
+        destroy_locks(f);
+        free(f);
+        return NULL;
+    }
+    if (!dcache_init(f, DCACHE_ENTRIES)) {
+        aio_destroy(f);
+        rec_destroy(f);
+        trace_destroy(f);
+        destroy_locks(f);
+        bcache_destroy(f);
+        free(f);
+        return NULL;
     }
     f->dno = 1;
     f->cdir[0] = '/';
@@ -175,111 +196,469 @@ static fs * new_fs() {
     return f;
 }
 
-static int bmap(fs *f, int ip, int bn){
+/*
+ * Physical block of logical block bn of inode ip, -1 for a hole. With
+ * alloc > 0 a missing block is allocated; extent inodes allocate up to
+ * alloc blocks from bn on in one run. *run, if given, is set to the
+ * number of blocks from bn on that are mapped contiguously, and *fresh
+ * to whether they were allocated just now and hold nothing yet.
+ */
+static int bmap(fs *f, int ip, int bn, int alloc, int *run, int *fresh){
     const int ic = blocksz/sizeof(int);
+    inode* inode = iget(f, ip);
+    if (inode->mode & I_EXTENT) return ext_map(f, ip, bn, alloc, run, fresh);
+
+    if (run) *run = 1;
+    if (fresh) *fresh = 0;
     if (bn < 0 || bn >= ic*8) return -1;
-    inode* inode = &f->inodes[ip];
     if (!(inode->mode&2) && bn >= 8) {
-        buffer *bp = openblk(f, alloc_blk(f));
-        memset(bp->d, 0, sizeof(bp->d));
+        if (!alloc) return -1;
+        buffer *bp = getblk(f, alloc_blk(f), BUF_META);
+        if (bp == NULL) return -1;
+        memset(bp->d, 0, blocksz);
         bp->dirty = 1;
         memcpy(bp->d, inode->block_id, sizeof(inode->block_id));
         memset(inode->block_id, 0, sizeof(inode->block_id));
         inode->block_id[0] = bp->bid;
         inode->mode |= 2;
+        brelse(f, bp);
+    }
+    /*
+     * A run only reaches over blocks that already existed: a block
+     * allocated just now is returned alone, since whatever follows it
+     * on disk holds data that must not be taken for fresh.
+     */
+    if (!(inode->mode&2)) {
+        int *ids = inode->block_id, k;
+        if (!ids[bn] && alloc) {
+            ids[bn] = alloc_blk(f);
+            if (ids[bn] <= 0) return -1;
+            if (fresh) *fresh = 1;
+            return ids[bn];
+        }
+        if (ids[bn] <= 0) return -1;
+        for (k = bn + 1; run && k < 8 && ids[k] == ids[bn] + k - bn; ++k)
+            ;
+        if (run) *run = k - bn;
+        return ids[bn];
     }
-    if (!(inode->mode&2)) return inode->block_id[bn] ?
-                              inode->block_id[bn] :
-                              (inode->block_id[bn]=alloc_blk(f));
     
-    buffer* bp = openblk(f, bn/ic);
-    int *ptr = (int*)bp->d;
-    if (!ptr[bn%ic]){
+    if (!inode->block_id[bn/ic]) {
+        if (!alloc) return -1;
+        buffer *bp = getblk(f, alloc_blk(f), BUF_META);
+        if (bp == NULL) return -1;
+        memset(bp->d, 0, blocksz);
+        bp->dirty = 1;
+        inode->block_id[bn/ic] = bp->bid;
+        brelse(f, bp);
+    }
+    stat_add(f, ST_MAP_LOAD, 1);
+    buffer* bp = openblk(f, inode->block_id[bn/ic], BUF_META);
+    if (bp == NULL) return -1;
+    int *ptr = (int*)bp->d, isnew = 0;
+    if (!ptr[bn%ic] && alloc){
         bp->dirty = 1;
         ptr[bn%ic] = alloc_blk(f);
+        isnew = 1;
+        if (fresh) *fresh = 1;
     }
-    return ptr[bn%ic];
+    int ret = ptr[bn%ic] > 0 ? ptr[bn%ic] : -1, k;
+    for (k = bn%ic + 1; run && !isnew && ret != -1 && k < ic && ptr[k] == ret + k - bn%ic; ++k)
+        ;
+    if (run && !isnew && ret != -1) *run = k - bn%ic;
+    brelse(f, bp);
+    return ret;
 }
 
+/*
+ * bmap() through the cursor of a descriptor, which remembers the last
+ * run it returned: blocks inside that run are mapped without looking at
+ * the inode or its tree. Freeing blocks of any file invalidates every
+ * cursor. cur may be NULL.
+ */
+static int bmap_cur(fs *f, int ip, int bn, int alloc, int *run, int *fresh,
+                    mapcur *cur){
+    unsigned int gen;
+    int pb;
+    if (cur == NULL) return bmap(f, ip, bn, alloc, run, fresh);
+    gen = __atomic_load_n(&f->map_gen, __ATOMIC_ACQUIRE);
+    if (cur->len > 0 && cur->gen == gen && bn >= cur->lblk &&
+        bn < cur->lblk + cur->len) {
+        *run = cur->lblk + cur->len - bn;
+        if (fresh) *fresh = 0;
+        return cur->pblk + (bn - cur->lblk);
+    }
+    pb = bmap(f, ip, bn, alloc, run, fresh);
+    cur->len = 0;
+    if (pb != -1) {
+        cur->lblk = bn;
+        cur->pblk = pb;
+        cur->len = *run;
+        cur->gen = gen;
+    }
+    return pb;
+}
 
-static int writei(fs *f, int ip, int off, const void* ptr, int size){
-    if (size == 0) return 0;
-    if (size < 0 || size + off >= MAX_FILE_SIZE) return -1;
-    int ret = size;
-    const char* src = ptr;
-    if (off % blocksz){
-        buffer* bp = openblk(f, bmap(f, ip, off/blocksz));
-        bp->dirty = 1;
-        int t = blocksz - off % blocksz;
-        if (t > size) t = size;
-        memcpy(bp->d+off % blocksz, src, t);
-        size -= t;
-        src += t;
-        off += t;
+/* position in an array of fs_iovec */
+typedef struct iocur_ {
+    const fs_iovec * v;
+    size_t pos;
+} iocur;
+
+/* bytes described by iov, -1 if more than an int can count */
+static int iov_total(const fs_iovec * iov, int cnt) {
+    size_t n = 0;
+    int i;
+    if (cnt < 0) return -1;
+    for (i = 0; i < cnt; ++i) {
+        if (iov[i].len > (size_t) 0x7fffffff - n) return -1;
+        n += iov[i].len;
     }
+    return (int) n;
+}
 
-    while (size >= blocksz){
-        buffer* bp = openblk(f, bmap(f, ip, off/blocksz));
-        bp->dirty = 1;
-        memcpy(bp->d, src, blocksz);
+/*
+ * Move t bytes between p and the buffers at c, into them if to_iov is
+ * set. With p == NULL zeros are stored.
+ */
+static void iov_xfer(iocur * c, char * p, int t, int to_iov) {
+    while (t > 0) {
+        char * b = (char*) c->v->base + c->pos;
+        size_t n = c->v->len - c->pos;
+        if (n == 0) {
+            ++c->v;
+            c->pos = 0;
+            continue;
+        }
+        if (n > (size_t) t) n = t;
+        if (!to_iov)
+            memcpy(p, b, n);
+        else if (p)
+            memcpy(b, p, n);
+        else
+            memset(b, 0, n);
+        if (p) p += n;
+        c->pos += n;
+        t -= n;
+    }
+}
 
-        off += blocksz;
-        src += blocksz;
-        size -= blocksz;
+/*
+ * Write the buffers of iov at off of inode ip. The block map is looked
+ * up once per contiguous run, however the bytes are split among the
+ * buffers. A block that is overwritten whole or was just allocated is
+ * not read first; the unwritten part of a new block is zeroed.
+ */
+static int writeiv(fs *f, int ip, unsigned int off, const fs_iovec* iov, int cnt,
+                   mapcur *cur){
+    int size = iov_total(iov, cnt);
+    inode *in = iget(f, ip);
+    if (size == 0) return 0;
+    if (size < 0) return -1;
+    if (in->mode & I_EXTENT) {
+        if ((unsigned long long) off + size > MAX_EXT_FILE_SIZE) return -1;
     }
+    else if ((unsigned long long) off + size >= MAX_FILE_SIZE) return -1;
+    int ret = size;
+    int cls = (in->mode & (I_DIR | I_DIRIDX)) ? BUF_META : BUF_DATA;
+    int pb = -1, run = 0, fresh = 0;
+    iocur c = { iov, 0 };
 
-    if (size){
-        buffer* bp = openblk(f, bmap(f, ip, off/blocksz));
+    while (size > 0){
+        int bo = off % blocksz;
+        int t = blocksz - bo;
+        if (t > size) t = size;
+        if (run > 0) ++pb;
+        else pb = bmap_cur(f, ip, off/blocksz, (bo + size + blocksz - 1) / blocksz,
+                           &run, &fresh, cur);
+        buffer* bp = fresh || t == blocksz ? getblk(f, pb, cls) : openblk(f, pb, cls);
+        if (bp == NULL) return -1;
+        if (fresh && t < blocksz) {
+            memset(bp->d, 0, bo);
+            memset(bp->d + bo + t, 0, blocksz - bo - t);
+        }
+        iov_xfer(&c, bp->d + bo, t, 0);
         bp->dirty = 1;
-        memcpy(bp->d, src, size);
-        off += size;
+        brelse(f, bp);
+
+        --run;
+        off += t;
+        size -= t;
+        if (in->size < off) in->size = off;
     }
+    idirty(f, ip);
 
-    if (f->inodes[ip].size < off) f->inodes[ip].size = off;
     return ret;
 }
 
-static int readi(fs *f, int ip, int off, void* ptr, int size){
+static int readiv(fs *f, int ip, unsigned int off, const fs_iovec* iov, int cnt,
+                  mapcur *cur){
+    int size = iov_total(iov, cnt);
     if (size < 0) return -1;
-    inode *inode = &f->inodes[ip];
+    inode *inode = iget(f, ip);
+    if (off >= inode->size) return 0;
     if (size > inode->size - off) size = inode->size - off;
     if (!size) return 0;
 
     int ret = size;
-    char* dst = ptr;
-    if (off % blocksz){
-        buffer* bp = openblk(f, bmap(f, ip, off/blocksz));
-        int t = blocksz - off % blocksz;
+    int cls = (inode->mode & (I_DIR | I_DIRIDX)) ? BUF_META : BUF_DATA;
+    int pb = -1, run = 0;
+    iocur c = { iov, 0 };
+
+    while (size > 0){
+        int bo = off % blocksz;
+        int t = blocksz - bo;
         if (t > size) t = size;
-        memcpy(dst, bp->d+off % blocksz, t);
-        size -= t;
-        dst += t;
+        if (run > 0) ++pb;
+        else pb = bmap_cur(f, ip, off/blocksz, 0, &run, NULL, cur);
+        if (pb == -1)
+            iov_xfer(&c, NULL, t, 1);
+        else {
+            buffer* bp = openblk(f, pb, cls);
+            if (bp == NULL) return -1;
+            iov_xfer(&c, bp->d + bo, t, 1);
+            brelse(f, bp);
+        }
+
+        --run;
         off += t;
+        size -= t;
     }
 
-    while (size >= blocksz){
-        buffer* bp = openblk(f, bmap(f, ip, off/blocksz));
-        memcpy(dst, bp->d, blocksz);
+    return ret;
+}
 
-        off += blocksz;
-        dst += blocksz;
-        size -= blocksz;
+static int writei(fs *f, int ip, unsigned int off, const void* ptr, int size){
+    fs_iovec v;
+    if (size < 0) return -1;
+    v.base = (void*) ptr;
+    v.len = size;
+    return writeiv(f, ip, off, &v, 1, NULL);
+}
+
+static int readi(fs *f, int ip, unsigned int off, void* ptr, int size){
+    fs_iovec v;
+    if (size < 0) return -1;
+    v.base = ptr;
+    v.len = size;
+    return readiv(f, ip, off, &v, 1, NULL);
+}
+
+/*
+ * Probe the index xi of directory dir for name. Returns the dentry index
+ * or -1; *slot is set to the matching slot, or to the slot a new entry
+ * for name should go to.
+ */
+static int idx_probe(fs * f, int dir, int xi, const diridx_hdr * h,
+                     const char * name, unsigned int hv, int * slot) {
+    diridx_slot s;
+    dentry ent;
+    int i, n, ins = -1;
+    int mask = h->nslot - 1;
+
+    for (n = 0, i = hv & mask; n < h->nslot; ++n, i = (i + 1) & mask) {
+        stat_add(f, ST_DIRENT_SCAN, 1);
+        if (readi(f, xi, IDX_SLOT_OFF(i), &s, sizeof(s)) != sizeof(s))
+            break;
+        if (s.pos == 0) {
+            *slot = ins >= 0 ? ins : i;
+            return -1;
+        }
+        if (s.pos < 0) {
+            if (ins < 0) ins = i;
+            continue;
+        }
+        if (s.hash == hv &&
+            readi(f, dir, (s.pos - 1) * sizeof(dentry), &ent, sizeof(ent)) == sizeof(ent) &&
+            strcmp(ent.fname, name) == 0) {
+            *slot = i;
+            return s.pos - 1;
+        }
     }
+    *slot = ins;
+    return -1;
+}
 
-    if (size){
-        buffer* bp = openblk(f, bmap(f, ip, off/blocksz));
-        memcpy(dst, bp->d, size);
+/*
+ * Stop indexing dir, whose index could not be kept up to date; lookups
+ * go back to scanning the dentries.
+ */
+static void idx_drop(fs * f, int dir) {
+    inode * in = iget(f, dir);
+    if (!(in->mode & I_INDEXED)) return;
+    in->mode &= ~I_INDEXED;
+    free_inode(f, in->next_id);
+    in->next_id = 0;
+    idirty(f, dir);
+}
+
+/*
+ * (Re)build the index of dir with nslot slots from its dentries. If
+ * that fails the directory is left without an index.
+ */
+static int idx_build(fs * f, int dir, int nslot) {
+    inode * in = iget(f, dir);
+    diridx_slot * tab;
+    dentry * ents;
+    diridx_hdr h;
+    int xi, k, n, i;
+    const int chunk = blocksz / sizeof(dentry);
+
+    while (nslot < in->dcnt * 2)
+        nslot *= 2;
+    tab = calloc(nslot, sizeof(diridx_slot));
+    ents = malloc(chunk * sizeof(dentry));
+    if (tab == NULL || ents == NULL) {
+        free(tab);
+        free(ents);
+        idx_drop(f, dir);
+        return 0;
     }
 
-    return ret;
+    for (k = 0; k < in->dcnt; k += n) {
+        n = in->dcnt - k < chunk ? in->dcnt - k : chunk;
+        if (readi(f, dir, k * sizeof(dentry), ents, n * sizeof(dentry)) !=
+            (int) (n * sizeof(dentry))) {
+            free(tab);
+            free(ents);
+            idx_drop(f, dir);
+            return 0;
+        }
+        for (i = 0; i < n; ++i) {
+            unsigned int hv = name_hash(ents[i].fname);
+            int j = hv & (nslot - 1);
+            while (tab[j].pos)
+                j = (j + 1) & (nslot - 1);
+            tab[j].hash = hv;
+            tab[j].pos = k + i + 1;
+        }
+    }
+    free(ents);
+
+    if (in->mode & I_INDEXED)
+        xi = in->next_id;
+    else if ((xi = ialloc(f, dir, 0)) == -1) {
+        free(tab);
+        return 0;
+    }
+    iget(f, xi)->mode |= I_DIRIDX;
+    h.magic = DIRIDX_MAGIC;
+    h.nslot = nslot;
+    h.used = in->dcnt;
+    h.tombs = 0;
+    if (writei(f, xi, 0, &h, sizeof(h)) != sizeof(h) ||
+        writei(f, xi, IDX_SLOT_OFF(0), tab, nslot * sizeof(diridx_slot)) !=
+        (int) (nslot * sizeof(diridx_slot))) {
+        free(tab);
+        if (in->mode & I_INDEXED)
+            idx_drop(f, dir);
+        else
+            free_inode(f, xi);
+        return 0;
+    }
+    free(tab);
+    in->next_id = xi;
+    in->mode |= I_INDEXED;
+    idirty(f, dir);
+    return 1;
 }
 
-static void add_entry(fs * f, int to, const char* str, int id) {
+/*
+ * Index of the dentry called name in dir, -1 if there is none. *ino is
+ * set to the inode it names. Answers come from the dentry cache when
+ * possible; otherwise the index or the dentry array is searched and the
+ * result, found or not, is cached.
+ */
+static int dir_lookup(fs * f, int dir, const char * name, int * ino) {
     dentry ent;
+    int k = -1;
+
+    stat_add(f, ST_LOOKUP, 1);
+    if (dcache_lookup(f, dir, name, ino, &k)) {
+        stat_add(f, ST_DCACHE_HIT, 1);
+        return k;
+    }
+
+    *ino = -1;
+    if (iget(f, dir)->mode & I_INDEXED) {
+        diridx_hdr h;
+        int slot;
+        int xi = iget(f, dir)->next_id;
+        if (readi(f, xi, 0, &h, sizeof(h)) == sizeof(h) && h.magic == DIRIDX_MAGIC) {
+            k = idx_probe(f, dir, xi, &h, name, name_hash(name), &slot);
+            if (k >= 0 && readi(f, dir, k * sizeof(ent), &ent, sizeof(ent)) == sizeof(ent))
+                *ino = ent.inode;
+            else
+                k = -1;
+            dcache_enter(f, dir, name, *ino, k);
+            return k;
+        }
+    }
+
+    for (k = 0; k < iget(f, dir)->dcnt; ++k) {
+        if (readi(f, dir, k * sizeof(ent), &ent, sizeof(ent)) != sizeof(ent))
+            break;
+        stat_add(f, ST_DIRENT_SCAN, 1);
+        if (strcmp(ent.fname, name) == 0) {
+            *ino = ent.inode;
+            dcache_enter(f, dir, name, *ino, k);
+            return k;
+        }
+    }
+    dcache_enter(f, dir, name, -1, -1);
+    return -1;
+}
+
+/* add the dentry str -> id to directory to; -1 if it cannot be written */
+static int add_entry(fs * f, int to, const char* str, int id) {
+    dentry ent;
+    diridx_hdr h;
+    diridx_slot s, old;
+    int slot;
+    int xi = iget(f, to)->next_id;
+
+    memset(&ent, 0, sizeof(ent));
     strcpy(ent.fname, str);
     ent.inode = id;
-    writei(f, to, f->inodes[to].dcnt * sizeof(dentry), &ent, sizeof(ent));
-    ++f->inodes[to].dcnt;
+    if (writei(f, to, iget(f, to)->dcnt * sizeof(dentry), &ent, sizeof(ent)) !=
+        sizeof(ent))
+        return -1;
+    dcache_enter(f, to, str, id, iget(f, to)->dcnt);
+    ++iget(f, to)->dcnt;
+    idirty(f, to);
+
+    if (!(iget(f, to)->mode & I_INDEXED)) {
+        if ((iget(f, to)->mode & I_DIR) && iget(f, to)->dcnt >= DIRIDX_MIN)
+            idx_build(f, to, DIRIDX_MIN * 2);
+        return 0;
+    }
+    /* an index that cannot take the name is rebuilt or dropped */
+    if (readi(f, xi, 0, &h, sizeof(h)) != sizeof(h) || h.magic != DIRIDX_MAGIC) {
+        idx_drop(f, to);
+        return 0;
+    }
+    if ((h.used + h.tombs + 1) * 4 > h.nslot * 3) {
+        idx_build(f, to, h.nslot * 2);
+        return 0;
+    }
+    s.hash = name_hash(str);
+    idx_probe(f, to, xi, &h, str, s.hash, &slot);
+    if (slot < 0) {
+        idx_build(f, to, h.nslot * 2);
+        return 0;
+    }
+    s.pos = iget(f, to)->dcnt;
+    if (readi(f, xi, IDX_SLOT_OFF(slot), &old, sizeof(old)) != sizeof(old) ||
+        writei(f, xi, IDX_SLOT_OFF(slot), &s, sizeof(s)) != sizeof(s)) {
+        idx_drop(f, to);
+        return 0;
+    }
+    if (old.pos < 0)
+        --h.tombs;
+    ++h.used;
+    if (writei(f, xi, 0, &h, sizeof(h)) != sizeof(h))
+        idx_drop(f, to);
+    return 0;
 }
 
 static int backwards(const char* buf, int last, int cnt)
@@ -350,61 +729,68 @@ static int split_dir(char* path, char* p[])
 }
 
 /*
- *open inode by the path. relative path is supported.
- *If the create_flag is 0, then -1 will be returned if the path not exist.
- *if the create_flag is 1, a new file will be created if the last level of the path not exist.
- *If the create_flag is 2, father's inode will be returned.
- * */
-static int openi(fs* f, const char* path, int create_flag)
+ * Resolve path, relative paths included, in a single walk. On success
+ * lk->parent is the directory that holds (or would hold) the last
+ * component and lk->name is that component; lk->ino and lk->pos are -1
+ * if it does not exist. The root resolves to itself with an empty name.
+ * Returns -1 if a directory on the way is missing.
+ */
+static int resolve(fs* f, const char* path, lookup* lk)
 {
-    dentry entry;
     char full_path[500];
     char* p[50];
-
-    int count, this_inode = 0, offset, i=0, bytes_get, father_inode = 0;
+    int count, i, dir = 0, ino, pos;
 
     if (path[0] == '/')
-        strcpy(full_path, path);
+        i = snprintf(full_path, sizeof(full_path), "%s", path);
     else
-        sprintf(full_path, "%s/%s", f->cdir, path);
+        i = snprintf(full_path, sizeof(full_path), "%s/%s", f->cdir, path);
+    if (i < 0 || i >= (int) sizeof(full_path)) return -1;
     format_path(full_path);
 
+    lk->parent = 0;
+    lk->ino = 0;
+    lk->pos = -1;
+    lk->name[0] = '\0';
     count = split_dir(full_path+1, p);
+    if ( count>1 && *p[count-1]==0 ) count--;
     if ( count<=0 ) return 0;
-    
-    while ( i<count )
-    {
-        offset = 0;
-        while ( (bytes_get = readi(f, this_inode, offset, &entry, sizeof(entry))) ) {
-            if ( strcmp(p[i], entry.fname)==0 ) break;
-            offset += sizeof(entry);
-        }
-        if (bytes_get>0){
-            father_inode = this_inode;
-            this_inode = entry.inode;
-            i++;
+
+    for (i = 0; i < count; ++i) {
+        if (!(iget(f, dir)->mode & I_DIR)) return -1;
+        if (strlen(p[i]) >= MAX_FNAME_LEN) return -1;
+        pos = dir_lookup(f, dir, p[i], &ino);
+        if (i == count - 1) {
+            lk->parent = dir;
+            lk->ino = pos >= 0 ? ino : -1;
+            lk->pos = pos;
+            strcpy(lk->name, p[i]);
+            return 0;
         }
-        else break;
+        if (pos < 0) return -1;
+        dir = ino;
     }
-    if ( i>=count ) {
-        return (create_flag==2)?father_inode:this_inode;
-    }
-    if ( i+1>=count && create_flag ){
-        if (create_flag == 2) return this_inode;
-        i = f->sb.free_inode; 
-        if ( i==0 ) return -1;
-        else {
-            f->sb.free_inode = f->inodes[i].next_id;
-            add_entry(f, this_inode, p[count-1], i);
-            return i;
-        }
+    return 0;
+}
+
+/* create the missing last component of a resolved path */
+static int create_at(fs* f, lookup* lk, int dir)
+{
+    int ino = ialloc(f, lk->parent, dir);
+    if (ino == -1) return -1;
+    if (dir) iget(f, ino)->mode |= I_DIR;
+    idirty(f, ino);
+    if (add_entry(f, lk->parent, lk->name, ino) == -1) {
+        free_inode(f, ino);
+        return -1;
     }
-    return -1;
+    lk->ino = ino;
+    lk->pos = iget(f, lk->parent)->dcnt - 1;
+    return ino;
 }
 
 static int init_super_block(fs * f, int nblk, int ninode) {
     superblock * sb;
-    int i;
     int ret;
 
     sb = &f->sb;
@@ -413,33 +799,25 @@ static int init_super_block(fs * f, int nblk, int ninode) {
     // 1. set_magic_number:
     memcpy(sb->magic_number, magic, sizeof(sb->magic_number));
 
-    // 2. init blk
-    ret = 1;
-    sb->total_free_block_num = 0;
-    sb->block_cnt = 0;
+    // 2. init blk and inode
     sb->block_offset = blocksz * (1 + ninode / inodect) ;
-    for (i = 0; ret == 1 && i < nblk; ++i)
-        ret = free_blk(f, i);
-
-    // 3. init inode
     sb->inode_cnt = ninode;
-    memset(f->inodes, 0, sizeof(inode) * ninode);
-    sb->free_inode = 1;
-    for (i = 2; i < ninode; ++i)
-        f->inodes[i-1].next_id = i;
+    // the image starts out as zeros, which is a table of free inodes
+    ret = balloc_init(f, nblk, ninode);
     
     // init root dir:
-    f->inodes[0].mode |= 1;
-    f->inodes[0].ref_count = 255;
-    add_entry(f, 0, ".", 0);
-    add_entry(f, 0, "..", 0);
+    iget(f, 0)->mode = I_DIR | I_EXTENT;
+    iget(f, 0)->ref_count = 255;
+    idirty(f, 0);
+    if (add_entry(f, 0, ".", 0) == -1 || add_entry(f, 0, "..", 0) == -1)
+        return 0;
         
     return ret;
 }
 
 static fs_dir* opendiri(fs *f,  int inode) {
     if (inode == -1) return 0;
-    if (!(f->inodes[inode].mode&1)) return 0;
+    if (!(iget(f, inode)->mode&1)) return 0;
     fs_dir* ret = malloc(sizeof(fs_dir));
     ret->f = f;
     ret->cur_off = 0;
@@ -447,105 +825,346 @@ static fs_dir* opendiri(fs *f,  int inode) {
     return ret;
 }
 
-static void remove_entry(fs* f, int father_inode, int son_inode)
+/*
+ * Remove the resolved entry lk and free its inode. The last dentry is
+ * moved into the hole, and the index is updated to match, or rebuilt if
+ * it does not have the slots expected.
+ */
+static void remove_entry(fs* f, const lookup* lk)
 {
     dentry entry;
-    int offset = 0, bytes_get;
-    while ( (bytes_get = readi(f, father_inode, offset, &entry, sizeof(entry)))>0 ){
-        if ( entry.inode == son_inode )
-            break;
-        offset += sizeof(entry);
+    diridx_hdr h;
+    diridx_slot s;
+    int last, slot, rebuild = 0;
+    int father_inode = lk->parent;
+    int k = lk->pos;
+    const char* name = lk->name;
+    int indexed = iget(f, father_inode)->mode & I_INDEXED;
+    int xi = iget(f, father_inode)->next_id;
+
+    dcache_enter(f, father_inode, name, -1, -1);
+    last = iget(f, father_inode)->dcnt - 1;
+    if (indexed) {
+        s.hash = 0;
+        s.pos = -1;
+        if (readi(f, xi, 0, &h, sizeof(h)) == sizeof(h) && h.magic == DIRIDX_MAGIC &&
+            idx_probe(f, father_inode, xi, &h, name, name_hash(name), &slot) == k &&
+            slot >= 0 &&
+            writei(f, xi, IDX_SLOT_OFF(slot), &s, sizeof(s)) == sizeof(s)) {
+            --h.used;
+            ++h.tombs;
+        }
+        else
+            rebuild = 1;
     }
-    if ( bytes_get > 0 )
-    {
-        readi(f, father_inode, sizeof(entry)*(f->inodes[father_inode].dcnt-1), &entry, sizeof(entry) );
-        writei(f, father_inode, offset, &entry, sizeof(entry) );
-        f->inodes[father_inode].dcnt--;
+    if (k != last) {
+        readi(f, father_inode, sizeof(entry)*last, &entry, sizeof(entry) );
+        writei(f, father_inode, sizeof(entry)*k, &entry, sizeof(entry) );
+        dcache_move(f, father_inode, entry.fname, k);
+        if (indexed && !rebuild) {
+            s.hash = name_hash(entry.fname);
+            if (idx_probe(f, father_inode, xi, &h, entry.fname, s.hash, &slot) == last &&
+                slot >= 0) {
+                s.pos = k + 1;
+                if (writei(f, xi, IDX_SLOT_OFF(slot), &s, sizeof(s)) != sizeof(s))
+                    rebuild = 1;
+            }
+            else
+                rebuild = 1;
+        }
+    }
+    iget(f, father_inode)->dcnt--;
+    idirty(f, father_inode);
+    if (indexed) {
+        if (!rebuild && writei(f, xi, 0, &h, sizeof(h)) != sizeof(h))
+            rebuild = 1;
+        if (rebuild || h.tombs * 4 > h.nslot)
+            idx_build(f, father_inode, DIRIDX_MIN * 2);
+    }
+
+    pthread_rwlock_wrlock(ILOCK(f, lk->ino));
+    free_inode(f, lk->ino);
+    pthread_rwlock_unlock(ILOCK(f, lk->ino));
+}
 
-        f->inodes[son_inode].next_id  = f->sb.free_inode;
-        f->sb.free_inode = son_inode;
+static void delete_fs(fs * f) {
+    aio_destroy(f);
+    rec_destroy(f);
+    trace_destroy(f);
+    destroy_locks(f);
+    free(f->idirty);
+    free(f->iloaded);
+    free(f->jnl.frees);
+    bcache_destroy(f);
+    dcache_destroy(f);
+    if (f->be != NULL) {
+        if (f->be->base == NULL)
+            free(f->inodes);
+        f->be->ops->close(f->be);
     }
+    free(f);
 }
 
-fs * fs_creatfs(const char* fname, int block_num, int inode_num) {
+/*
+ * Set up f->inodes for a table of inode_num entries. When the backend
+ * exports the image the table is used in place; otherwise it is read
+ * into memory when load is set.
+ */
+static int attach_inodes(fs * f, int inode_num, int load) {
+    long n = itbl_blocks(inode_num);
+    f->idirty = calloc((n + 7) / 8, 1);
+    f->iloaded = malloc((n + 7) / 8);
+    if (f->idirty == NULL || f->iloaded == NULL) return 0;
+    /* a new table is all zeros and a mapped one is read by the kernel */
+    memset(f->iloaded, load && f->be->base == NULL ? 0 : 0xff, (n + 7) / 8);
+    if (f->be->base != NULL) {
+        f->inodes = (inode*) (f->be->base + blocksz);
+        return 1;
+    }
+    /* pages of the table never touched are never backed by memory */
+    f->inodes = calloc(n, blocksz);
+    return f->inodes != NULL;
+}
+fs * fs_creatfs_opt(const char* fname, int block_num, int inode_num,
+                    const fs_opts * opts) {
     fs * f;
-    int i;
 
     if (block_num <= 10) return NULL;
-    if (fname == NULL) return NULL;
+    if (fname == NULL && backend_kind(opts) != FS_BK_MEM) return NULL;
     if (inode_num == -1) inode_num = block_num / 10;
     if (inode_num <= 0) return NULL;
 
     inode_num = ((inode_num - 1) / inodect + 1) * inodect;
 
-    f = new_fs();
-    f->fp = fopen(fname, "w+b");
-    if (f->fp == NULL) {
-        free(f);
+    f = new_fs(opts);
+    if (f == NULL) return NULL;
+    f->be = be_open(backend_kind(opts), fname,
+                    1 + inode_num / inodect + (long) block_num);
+    if (f->be == NULL ||
+        !attach_inodes(f, inode_num, 0) ||
+        !init_super_block(f, block_num, inode_num) ||
+        (opts && (opts->flags & FS_OPT_JOURNAL) &&
+         !jnl_create(f, opts->journal_blocks > 0 ? opts->journal_blocks :
+                     JOURNAL_BLOCKS)) ||
+        !flusher_start(f, opts)) {
+        delete_fs(f);
         return NULL;
     }
 
-    f->inodes = malloc( sizeof(inode) * inode_num );
-    if (f->inodes == NULL) {
-        free(f);
-        return NULL;
+    return f;
+}
+
+fs * fs_creatfs(const char* fname, int block_num, int inode_num) {
+    return fs_creatfs_opt(fname, block_num, inode_num, NULL);
+}
+
+/*
+ * Recover the journal of an image being opened and reload the superblock
+ * into f->sb, blk being a block of scratch space. A mapped image is
+ * reopened with pread/pwrite first, see backend_kind().
+ */
+static int open_journal(fs * f, const char * fname, const fs_opts * opts,
+                        char * blk) {
+    if (f->be->base != NULL) {
+        f->be->ops->close(f->be);
+        bcache_destroy(f);
+        if ((f->be = be_open(FS_BK_PIO, fname, 0)) == NULL ||
+            !bcache_init(f, opts ? opts->cache_size : 0, 0))
+            return 0;
     }
+    if (!jnl_recover(f) || !f->be->ops->read(f->be, 0, blk, 1))
+        return 0;
+    memcpy(&f->sb, blk, sizeof(f->sb));
+    return 1;
+}
 
-    if (!init_super_block(f, block_num, inode_num)) {
-        free(f->inodes);
-        free(f);
+fs * fs_openfs_opt(const char * fname, const fs_opts * opts) {
+    fs * f = new_fs(opts);
+    char * blk;
+    if (f == NULL) return NULL;
+    f->be = be_open(backend_kind(opts), fname, 0);
+    blk = malloc(blocksz);
+    if (f->be == NULL || blk == NULL || !f->be->ops->read(f->be, 0, blk, 1)) {
+        free(blk);
+        delete_fs(f);
         return NULL;
     }
-
-    fseek(f->fp, 0, SEEK_SET);
-    for (i = 0; i < f->sb.block_offset + block_num * blocksz; i+=blocksz) {
-        if (!fwrite(f->buf[0].d, blocksz, 1, f->fp)) {
-            free(f->inodes);
-            free(f);
-            return NULL;
-        }
+    memcpy(&f->sb, blk, sizeof(f->sb));
+    if (strcmp(f->sb.magic_number, magic) != 0 ||
+        (f->sb.feat_magic == FEAT_MAGIC && (f->sb.features & FEAT_JOURNAL) &&
+         !open_journal(f, fname, opts, blk)) ||
+        !attach_inodes(f, f->sb.inode_cnt, 1) ||
+        !flusher_start(f, opts)) {
+        free(blk);
+        delete_fs(f);
+        return NULL;
     }
-    
+    free(blk);
     return f;
 }
 
 fs * fs_openfs(const char * fname) {
-    fs * f = new_fs();
-    int inode_num;
-    f->fp = fopen(fname, "r+b");
-    if (f->fp == NULL) {
-        free(f);
-        return NULL;
+    return fs_openfs_opt(fname, NULL);
+}
+
+/*
+ * Read in blocks first .. last of the inode table, those not yet read.
+ * Blocks are only ever read once, so nothing read can be dirty.
+ */
+void iload(fs * f, long first, long last) {
+    long k;
+    pthread_mutex_lock(&f->itbl_lock);
+    for (k = first; k <= last; ++k) {
+        if (f->iloaded[k / 8] & (1 << (k % 8))) continue;
+        stat_add(f, ST_BLK_READ, 1);
+        if (!f->be->ops->read(f->be, 1 + k, (char*) f->inodes + k * blocksz, 1))
+            memset((char*) f->inodes + k * blocksz, 0, blocksz);
+        __atomic_fetch_or(&f->iloaded[k / 8], (unsigned char) (1 << (k % 8)),
+                          __ATOMIC_RELEASE);
     }
-    fseek(f->fp, 0, SEEK_SET);
-    fread(&f->sb, sizeof(f->sb), 1, f->fp);
-    if (strcmp(f->sb.magic_number, magic) != 0) {
-        free(f);
-        return NULL;
+    pthread_mutex_unlock(&f->itbl_lock);
+}
+
+/*
+ * Note that inode ino changed and its table block must be written.
+ * Writers of different files share table blocks, hence the atomic or.
+ */
+void idirty(fs * f, int ino) {
+    long first = sizeof(inode) * (long) ino / blocksz;
+    long last = (sizeof(inode) * (long) (ino + 1) - 1) / blocksz;
+    for (; first <= last; ++first)
+        __atomic_fetch_or(&f->idirty[first / 8], (unsigned char) (1 << (first % 8)),
+                          __ATOMIC_RELAXED);
+}
+
+/*
+ * Write the superblock and the modified blocks of the inode table back
+ * to the image, each run of adjacent modified blocks in one write.
+ */
+int write_super(fs * f) {
+    backend * be = f->be;
+    char * blk = calloc(1, blocksz);
+    long n = itbl_blocks(f->sb.inode_cnt);
+    long i, j;
+    int ret = 1;
+
+    if (blk == NULL) return 0;
+    memcpy(blk, &f->sb, sizeof(f->sb));
+    if (!be->ops->write(be, 0, blk, 1))
+        ret = 0;
+    free(blk);
+    stat_add(f, ST_BLK_WRITE, 1);
+
+#define ITBL_DIRTY(k) (f->idirty[(k) / 8] & (1 << ((k) % 8)))
+    for (i = 0; i < n; i = j) {
+        if (!ITBL_DIRTY(i)) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < n && ITBL_DIRTY(j); ++j)
+            ;
+        if (!be->ops->write(be, 1 + i, (char*) f->inodes + i * blocksz, j - i)) {
+            ret = 0;
+            continue;
+        }
+        stat_add(f, ST_BLK_WRITE, j - i);
+        for (; i < j; ++i)
+            f->idirty[i / 8] &= ~(1 << (i % 8));
     }
+#undef ITBL_DIRTY
+    return ret;
+}
 
-    inode_num = f->sb.inode_cnt;
-    f->inodes = malloc( sizeof(inode) * inode_num);
-    if (f->inodes == NULL) {
-        free(f);
-        return NULL;
+static int sync_locked(fs * f) {
+    int ret;
+    if (f->jnl.on)
+        return jnl_commit(f) && f->be->ops->flush(f->be) ? 0 : -1;
+    ret = bcache_flush(f);
+    if (!write_super(f) || !f->be->ops->flush(f->be))
+        ret = 0;
+    return ret ? 0 : -1;
+}
+
+int fs_sync(fs * f) {
+    long t0 = trace_begin(f);
+    int ret;
+    pthread_rwlock_wrlock(&f->oplock);
+    ret = sync_locked(f);
+    pthread_rwlock_unlock(&f->oplock);
+    api_end(f, FS_OP_SYNC, t0, ret, -1, 0, 0, NULL);
+    return ret;
+}
+
+/* fd's table entry as of now; 0 if fd is not open */
+static int getfd(fs * f, int fd, fdesc * d) {
+    if (fd < 0 || fd >= MAX_FD) return 0;
+    pthread_rwlock_rdlock(&f->fdlock);
+    *d = f->fds[fd];
+    pthread_rwlock_unlock(&f->fdlock);
+    return d->used;
+}
+
+/* finish a call that held oplock shared, committing if it is time */
+static void op_end(fs * f) {
+    int want = jnl_want_commit(f);
+    pthread_rwlock_unlock(&f->oplock);
+    if (want) {
+        pthread_rwlock_wrlock(&f->oplock);
+        jnl_commit(f);
+        pthread_rwlock_unlock(&f->oplock);
     }
-    fseek(f->fp, blocksz, SEEK_SET);
-    fread(f->inodes, sizeof(inode) * inode_num, 1, f->fp);
-    return f;
+}
+
+static unsigned int isize(fs * f, int ino) {
+    unsigned int size;
+    pthread_rwlock_rdlock(ILOCK(f, ino));
+    size = iget(f, ino)->size;
+    pthread_rwlock_unlock(ILOCK(f, ino));
+    return size;
+}
+
+/*
+ * Make the data of fd and all metadata durable. Without a journal, data
+ * blocks of other files stay in the cache; with one, the commit writes
+ * out all dirty data first (ordered mode), so theirs go to disk too.
+ */
+int fs_fsync(fs * f, int fd) {
+    long t0 = trace_begin(f);
+    fdesc d;
+    int ip, nb, bn, run, k;
+    int ret = 0;
+    if (!getfd(f, fd, &d)) {
+        api_end(f, FS_OP_FSYNC, t0, -1, fd, 0, 0, NULL);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&f->oplock);
+    ip = d.inodeid;
+    nb = (iget(f, ip)->size + blocksz - 1) / blocksz;
+    for (bn = 0; bn < nb; bn += run) {
+        int pb = bmap(f, ip, bn, 0, &run, NULL);
+        for (k = 0; pb != -1 && k < run && bn + k < nb; ++k)
+            if (!bcache_flush_blk(f, pb + k))
+                ret = -1;
+    }
+    if (f->jnl.on) {
+        if (!jnl_commit(f) || !f->be->ops->flush(f->be))
+            ret = -1;
+    }
+    else if (!bcache_flush_cls(f, BUF_META) || !write_super(f) ||
+             !f->be->ops->flush(f->be))
+        ret = -1;
+    pthread_rwlock_unlock(&f->oplock);
+    api_end(f, FS_OP_FSYNC, t0, ret, fd, 0, 0, NULL);
+    return ret;
 }
 
 void fs_closefs(fs *f) {
-    int i = 0;
-    for (i = 0; i < 16; ++i)
-        if (f->buf[i].dirty)
-            writeblk(f, i);
-    fseek(f->fp, 0, SEEK_SET);
-    fwrite(&f->sb, blocksz, 1, f->fp);
-    fwrite(f->inodes, sizeof(inode)*f->sb.inode_cnt, 1, f->fp);
-    fclose(f->fp);
-    free(f->inodes);
-    free(f);
+    aio_stop(f);
+    flusher_stop(f);
+    if (f->jnl.on)
+        jnl_close(f);
+    sync_locked(f);
+    delete_fs(f);
 }
 
 int fs_errno(fs* f) {
@@ -553,118 +1172,359 @@ int fs_errno(fs* f) {
 }
 
 void fs_pwd(fs* f, char* buf, size_t buf_len) {
+    pthread_rwlock_rdlock(&f->nslock);
     int len = strlen(f->cdir);
     if (buf_len < len) len = buf_len;
     memcpy(buf, f->cdir, len);
     buf[len]=0;
+    pthread_rwlock_unlock(&f->nslock);
 }
 
-int fs_chdir(fs* f, const char* dir) {
+static int chdir_locked(fs* f, const char* dir) {
     char buf[MAX_PATH_LEN * 2];
+    int n;
     if (dir[0] == '/')
-        strcpy(buf, dir);
+        n = snprintf(buf, sizeof(buf), "%s", dir);
     else
-        sprintf(buf, "%s/%s", f->cdir, dir);
+        n = snprintf(buf, sizeof(buf), "%s/%s", f->cdir, dir);
+    if (n < 0 || n >= (int) sizeof(buf)) return -1;
     format_path(buf);
-    int dn = openi(f, buf, 0);
-    if (dn == -1 || ((f->inodes[dn].mode & 1) == 0)) return -1;
+    lookup lk;
+    if (resolve(f, buf, &lk) == -1) return -1;
+    int dn = lk.ino;
+    if (dn == -1 || ((iget(f, dn)->mode & 1) == 0)) return -1;
     f->dno = dn;
     strcpy(f->cdir, buf);
     return 1;
 }
 
-int fs_open(fs* f, const char* fname, int mode) {
-    int i;
-    int k = -1;
+int fs_chdir(fs* f, const char* dir) {
+    long t0 = trace_begin(f);
+    int ret;
+    pthread_rwlock_wrlock(&f->nslock);
+    ret = chdir_locked(f, dir);
+    pthread_rwlock_unlock(&f->nslock);
+    api_end(f, FS_OP_CHDIR, t0, ret, -1, 0, 0, dir);
+    return ret;
+}
+
+/*
+ * Called with oplock shared. The name is looked up under a shared
+ * namespace lock, which is taken again exclusively only if the file has
+ * to be created.
+ */
+static int open_locked(fs* f, const char* fname, int mode) {
+    lookup lk;
+    unsigned int off = 0;
+    int k;
     if ((mode & FS_WRITE) == 0)
         mode |= FS_EXSIT;
-    for (i = 0; i < MAX_FD; ++i)
-        if (f->fds[i].used == 0) {
-            k = i;
-            break;
-        }
-    if (k != -1) {
-        f->fds[k].inodeid = openi(f, fname, 0);
-        if (f->fds[k].inodeid == -1) {
-            if (mode & FS_EXSIT) return -1;
-        }
-        else {
-            if ((mode & FS_WRITE) && (mode & FS_APPEND) == 0) { // remove current file
-                f->fds[k].inodeid = -1;
-                fs_remove(f, fname);
-            }
-        }
+    pthread_rwlock_rdlock(&f->fdlock);
+    for (k = 0; k < MAX_FD && f->fds[k].used; ++k)
+        ;
+    pthread_rwlock_unlock(&f->fdlock);
+    if (k == MAX_FD) return -1;
+
+    pthread_rwlock_rdlock(&f->nslock);
+    if (resolve(f, fname, &lk) == -1) goto fail;
+    if (lk.ino == -1) {
+        if (mode & FS_EXSIT) goto fail;
+        pthread_rwlock_unlock(&f->nslock);
+        pthread_rwlock_wrlock(&f->nslock);
+        if (resolve(f, fname, &lk) == -1 ||
+            (lk.ino == -1 && create_at(f, &lk, 0) == -1))
+            goto fail;
+    }
+    else if (mode & FS_WRITE) {
+        if (iget(f, lk.ino)->mode & I_DIR) goto fail;
+        pthread_rwlock_wrlock(ILOCK(f, lk.ino));
+        if ((mode & FS_APPEND) == 0) // drop current contents
+            truncate_inode(f, lk.ino);
+        off = iget(f, lk.ino)->size;
+        pthread_rwlock_unlock(ILOCK(f, lk.ino));
+    }
 
-        if (f->fds[k].inodeid == -1) {
-            f->fds[k].inodeid = creatfile(f, fname);
-            if (f->fds[k].inodeid == -1)
-                return -1;
-        }
-        
+    pthread_rwlock_wrlock(&f->fdlock);
+    for (k = 0; k < MAX_FD && f->fds[k].used; ++k)
+        ;
+    if (k < MAX_FD) {
+        f->fds[k].inodeid = lk.ino;
         f->fds[k].used = 1;
         f->fds[k].mode = (mode & (FS_READ | FS_WRITE));
-        f->fds[k].offset = (mode & FS_APPEND) ? f->inodes[f->fds[k].inodeid].size: 0;
+        f->fds[k].dir = (iget(f, lk.ino)->mode & I_DIR) != 0;
+        f->fds[k].offset = (mode & FS_APPEND) ? off : 0;
+        f->fds[k].ra_next = 0;
+        f->fds[k].ra_end = 0;
+        f->fds[k].ra_win = 0;
+        f->fds[k].map.len = 0;
     }
+    else
+        k = -1;
+    pthread_rwlock_unlock(&f->fdlock);
+    pthread_rwlock_unlock(&f->nslock);
     return k;
+
+fail:
+    pthread_rwlock_unlock(&f->nslock);
+    return -1;
+}
+
+int fs_open(fs* f, const char* fname, int mode) {
+    long t0 = trace_begin(f);
+    int ret;
+    pthread_rwlock_rdlock(&f->oplock);
+    ret = open_locked(f, fname, mode);
+    op_end(f);
+    api_end(f, FS_OP_OPEN, t0, ret, -1, mode, 0, fname);
+    return ret;
 }
 
 void fs_close(fs* f, int fd) {
+    long t0;
     if (fd < 0 || fd >= MAX_FD) {
         return ;
     }
+    t0 = trace_begin(f);
+    pthread_rwlock_wrlock(&f->fdlock);
     f->fds[fd].used = 0;
+    pthread_rwlock_unlock(&f->fdlock);
+    api_end(f, FS_OP_CLOSE, t0, 0, fd, 0, 0, NULL);
+}
+
+/*
+ * Lock the file of d for reading or, with excl, for writing. Directories
+ * opened as files take the namespace lock as well, since that is what
+ * guards directories.
+ */
+static void lock_file(fs * f, const fdesc * d, int excl) {
+    if (d->dir)
+        pthread_rwlock_rdlock(&f->nslock);
+    if (excl)
+        pthread_rwlock_wrlock(ILOCK(f, d->inodeid));
+    else
+        pthread_rwlock_rdlock(ILOCK(f, d->inodeid));
+}
+
+static void unlock_file(fs * f, const fdesc * d) {
+    pthread_rwlock_unlock(ILOCK(f, d->inodeid));
+    if (d->dir)
+        pthread_rwlock_unlock(&f->nslock);
+}
+
+/*
+ * Readahead. Each descriptor remembers where a sequential reader would
+ * go on. A read starting there (or in the block it stopped in) is
+ * sequential and makes sure the next ra_win blocks are in the cache,
+ * asking for the next batch once the reader is within half a window of
+ * the end of the last one; the window doubles each time up to
+ * RA_MAX_BLOCKS. Any other read drops the window. Blocks that follow
+ * each other on disk are handed to the cache together, which reads them
+ * with one backend call.
+ */
+static void readahead(fs * f, fdesc * d, unsigned int off, int len) {
+    int first = off / blocksz, last, nb, max, bn, end, run, pb;
+    int rs = -1, rn = 0;
+    int cls = d->dir ? BUF_META : BUF_DATA;
+
+    if (len <= 0 || off >= iget(f, d->inodeid)->size) return;
+    if (first != d->ra_next && first + 1 != d->ra_next) {
+        d->ra_win = 0;
+        d->ra_end = 0;
+        d->ra_next = (off + len + blocksz - 1) / blocksz;
+        return;
+    }
+    max = f->bc.nbuf / 8;
+    if (max > RA_MAX_BLOCKS) max = RA_MAX_BLOCKS;
+    last = (off + len - 1) / blocksz;
+    d->ra_next = last + 1;
+    if (max < 2) return;
+    if (d->ra_win == 0)
+        d->ra_win = RA_MIN_BLOCKS < max ? RA_MIN_BLOCKS : max;
+    if (last + 1 + d->ra_win / 2 <= d->ra_end) return;
+
+    nb = (iget(f, d->inodeid)->size + blocksz - 1) / blocksz;
+    bn = first > d->ra_end ? first : d->ra_end;
+    end = last + 1 + d->ra_win;
+    if (end > nb) end = nb;
+    d->ra_end = end;
+    if (d->ra_win * 2 <= max) d->ra_win *= 2;
+    for (; bn < end; bn += run) {
+        pb = bmap(f, d->inodeid, bn, 0, &run, NULL);
+        if (run > end - bn) run = end - bn;
+        if (pb != -1 && rn > 0 && pb == rs + rn) {
+            rn += run;
+            continue;
+        }
+        if (rn > 0) bcache_readahead(f, rs, rn, cls);
+        rs = pb;
+        rn = pb != -1 ? run : 0;
+    }
+    if (rn > 0) bcache_readahead(f, rs, rn, cls);
+}
+
+/*
+ * Store what a transfer through fd learnt, with d being its entry as
+ * read before; with n > 0 the offset moves past the n bytes moved from
+ * d->offset on.
+ */
+static void put_fd(fs * f, int fd, const fdesc * d, int n) {
+    fdesc * e;
+    pthread_rwlock_wrlock(&f->fdlock);
+    e = &f->fds[fd];
+    if (e->used && e->inodeid == d->inodeid) {
+        e->ra_next = d->ra_next;
+        e->ra_end = d->ra_end;
+        e->ra_win = d->ra_win;
+        e->map = d->map;
+        if (n > 0)
+            e->offset = d->offset + n;
+    }
+    pthread_rwlock_unlock(&f->fdlock);
+}
+
+/*
+ * Read or write at off through the descriptor fd; off < 0 stands for
+ * the offset of fd, which is then advanced past what was transferred.
+ * The call is traced and recorded as ev.
+ */
+static int read_at(fs * f, int fd, long off, const fs_iovec * iov, int cnt,
+                   int ev) {
+    long t0 = trace_begin(f);
+    unsigned int pos = off;
+    fdesc d;
+    int ret = -1;
+    if (getfd(f, fd, &d)) {
+        pos = off < 0 ? d.offset : off;
+        lock_file(f, &d, 0);
+        readahead(f, &d, pos, iov_total(iov, cnt));
+        ret = readiv(f, d.inodeid, pos, iov, cnt, &d.map);
+        unlock_file(f, &d);
+        put_fd(f, fd, &d, off < 0 ? ret : 0);
+    }
+    api_end(f, ev, t0, ret, fd, t0 ? iov_total(iov, cnt) : 0, pos, NULL);
+    return ret;
+}
+
+static int write_at(fs * f, int fd, long off, const fs_iovec * iov, int cnt,
+                    int ev) {
+    long t0 = trace_begin(f);
+    unsigned int pos = off;
+    fdesc d;
+    int ret = -1;
+    if (getfd(f, fd, &d)) {
+        pos = off < 0 ? d.offset : off;
+        pthread_rwlock_rdlock(&f->oplock);
+        lock_file(f, &d, 1);
+        ret = writeiv(f, d.inodeid, pos, iov, cnt, &d.map);
+        unlock_file(f, &d);
+        op_end(f);
+        put_fd(f, fd, &d, off < 0 ? ret : 0);
+    }
+    api_end(f, ev, t0, ret, fd, t0 ? iov_total(iov, cnt) : 0, pos, NULL);
+    return ret;
 }
 
 int fs_read(fs* f, int fd, void* buf, size_t size) {
-    if (!f->fds[fd].used) return -1;
-    return readi(f, f->fds[fd].inodeid, f->fds[fd].offset, buf, size);
+    fs_iovec v = { buf, size };
+    return read_at(f, fd, -1, &v, 1, FS_OP_READ);
 }
 
 int fs_write(fs* f, int fd, const void* buf, size_t size) {
-    if (!f->fds[fd].used) return -1;
-    return writei(f, f->fds[fd].inodeid, f->fds[fd].offset, buf, size);
+    fs_iovec v = { (void*) buf, size };
+    return write_at(f, fd, -1, &v, 1, FS_OP_WRITE);
 }
 
-int fs_seek(fs* f, int fd, int offset, int mode) {
-    if (!f->fds[fd].used) return -1;
-    int off = f->fds[fd].offset, size = f->inodes[f->fds[fd].inodeid].size;
+int fs_readv(fs* f, int fd, const fs_iovec* iov, int cnt) {
+    return read_at(f, fd, -1, iov, cnt, FS_OP_READV);
+}
+
+int fs_writev(fs* f, int fd, const fs_iovec* iov, int cnt) {
+    return write_at(f, fd, -1, iov, cnt, FS_OP_WRITEV);
+}
+
+int fs_pread(fs* f, int fd, void* buf, size_t size, unsigned int offset) {
+    fs_iovec v = { buf, size };
+    return read_at(f, fd, offset, &v, 1, FS_OP_PREAD);
+}
+
+int fs_pwrite(fs* f, int fd, const void* buf, size_t size, unsigned int offset) {
+    fs_iovec v = { (void*) buf, size };
+    return write_at(f, fd, offset, &v, 1, FS_OP_PWRITE);
+}
+
+static int seek_fd(fs* f, int fd, int offset, int mode) {
+    fdesc d;
+    long off, size;
+    if (!getfd(f, fd, &d)) return -1;
+    off = d.offset;
+    size = isize(f, d.inodeid);
     if (mode == FS_SET) off = offset;
-    else if (mode == FS_END) off = size + offset - 1;
+    else if (mode == FS_END) off = size + offset;
     else if (mode == FS_CUR) off += offset;
     else return -1;
-    return off < 0 || off >= size ? -1 : 0;
+    if (off < 0 || off > size) return -1;
+    pthread_rwlock_wrlock(&f->fdlock);
+    if (f->fds[fd].used && f->fds[fd].inodeid == d.inodeid)
+        f->fds[fd].offset = off;
+    pthread_rwlock_unlock(&f->fdlock);
+    return 0;
+}
+
+int fs_seek(fs* f, int fd, int offset, int mode) {
+    long t0 = trace_begin(f);
+    int ret = seek_fd(f, fd, offset, mode);
+    api_end(f, FS_OP_SEEK, t0, ret, fd, offset, mode, NULL);
+    return ret;
 }
 
 unsigned int fs_tell(fs* f, int fd) {
-    if (!f->fds[fd].used) return -1;
-    return f->fds[fd].offset;
+    fdesc d;
+    if (!getfd(f, fd, &d)) return -1;
+    return d.offset;
 }
 
 int fs_eof(fs* f, int fd) {
-    if (!f->fds[fd].used) return -1;
-    return f->fds[fd].offset == f->inodes[f->fds[fd].inodeid].size - 1;
+    fdesc d;
+    if (!getfd(f, fd, &d)) return -1;
+    return d.offset >= isize(f, d.inodeid);
 }
 
 int fs_fstat(fs* f, int fd, inode* inode) {
-    if (!f->fds[fd].used) return -1;
-    memcpy(inode, &f->inodes[f->fds[fd].inodeid], sizeof(*inode));
-    return 0;
+    long t0 = trace_begin(f);
+    fdesc d;
+    int ret = -1;
+    if (getfd(f, fd, &d)) {
+        pthread_rwlock_rdlock(ILOCK(f, d.inodeid));
+        memcpy(inode, iget(f, d.inodeid), sizeof(*inode));
+        pthread_rwlock_unlock(ILOCK(f, d.inodeid));
+        ret = 0;
+    }
+    api_end(f, FS_OP_FSTAT, t0, ret, fd, 0, 0, NULL);
+    return ret;
 }
 
-int fs_remove(fs* f, const char* path) {
-    int ino;
-    int fno;
-    ino = openi(f, path, 0);
-    if (ino == -1 || (f->inodes[ino].mode & 1) == 1) {
+static int remove_locked(fs* f, const char* path) {
+    lookup lk;
+    if (resolve(f, path, &lk) == -1 || lk.pos == -1 ||
+        (iget(f, lk.ino)->mode & 1) == 1) {
         return -1;
     }
-    fno = openi(f, path, 2);
-    if (fno == -1) return -1;
-    release_inode_blk(f, ino);
-    remove_entry(f, fno, ino);
+    remove_entry(f, &lk);
     return 0;
 }
 
+int fs_remove(fs* f, const char* path) {
+    long t0 = trace_begin(f);
+    int ret;
+    pthread_rwlock_rdlock(&f->oplock);
+    pthread_rwlock_wrlock(&f->nslock);
+    ret = remove_locked(f, path);
+    pthread_rwlock_unlock(&f->nslock);
+    op_end(f);
+    api_end(f, FS_OP_REMOVE, t0, ret, -1, 0, 0, path);
+    return ret;
+}
+
 /* static char* find_parent_and_son(char* path) */
 /* { */
 /*     int len = strlen(path); */
@@ -677,43 +1537,60 @@ int fs_remove(fs* f, const char* path) {
 /*     return path+len+1; */
 /* } */
 
-int fs_mkdir(fs* f, const char* path)
+static int mkdir_locked(fs* f, const char* path)
 {
-    char full_path[500];
-    
-    int ino_parent, new_inode;
-    
-    sprintf(full_path, "%s/%s", f->cdir, path);
-    format_path(full_path);
+    lookup lk;
+    int new_inode;
 
-    if (openi(f, full_path, 0) != -1) return -1;
-    if ((ino_parent = openi(f, full_path, 2)) == -1) return -1;
-    if ((new_inode = openi(f, full_path, 1)) == -1) return -1;
+    if (resolve(f, path, &lk) == -1 || lk.ino != -1) return -1;
+    if ((new_inode = create_at(f, &lk, 1)) == -1) return -1;
 
-    f->inodes[new_inode].mode |= 1;
-    
-    add_entry(f, new_inode, ".", new_inode);
-    add_entry(f, new_inode, "..", ino_parent);
+
+    if (add_entry(f, new_inode, ".", new_inode) == -1 ||
+        add_entry(f, new_inode, "..", lk.parent) == -1) {
+        remove_entry(f, &lk);
+        return -1;
+    }
 
     return 1;
 }
 
-int fs_removedir(fs* f, const char* dir) {
-    int ino;
-    int fno;
-    ino = openi(f, dir, 0);
-    if (ino == -1 || 
-        (f->inodes[ino].mode & 1) == 0 ||
-        f->inodes[ino].dcnt > 0) {
+int fs_mkdir(fs* f, const char* path)
+{
+    long t0 = trace_begin(f);
+    int ret;
+    pthread_rwlock_rdlock(&f->oplock);
+    pthread_rwlock_wrlock(&f->nslock);
+    ret = mkdir_locked(f, path);
+    pthread_rwlock_unlock(&f->nslock);
+    op_end(f);
+    api_end(f, FS_OP_MKDIR, t0, ret, -1, 0, 0, path);
+    return ret;
+}
+
+static int removedir_locked(fs* f, const char* dir) {
+    lookup lk;
+    if (resolve(f, dir, &lk) == -1 || lk.pos == -1 ||
+        (iget(f, lk.ino)->mode & 1) == 0 ||
+        iget(f, lk.ino)->dcnt > 2) {   /* only . and .. left */
         return -1;
     }
-    fno = openi(f, dir, 2);
-    if (fno == -1) return -1;
-    release_inode_blk(f, ino);
-    remove_entry(f, fno, ino);
+    remove_entry(f, &lk);
     return 0;
 }
 
+int fs_removedir(fs* f, const char* dir) {
+    long t0 = trace_begin(f);
+    int ret;
+    pthread_rwlock_rdlock(&f->oplock);
+    pthread_rwlock_wrlock(&f->nslock);
+    ret = removedir_locked(f, dir);
+    pthread_rwlock_unlock(&f->nslock);
+    op_end(f);
+    api_end(f, FS_OP_REMOVEDIR, t0, ret, -1, 0, 0, dir);
+    return ret;
+}
+
 fs_dir * fs_opendir(fs* f, const char* path) {
     /* fs_dir * dir = malloc(sizeof(fs_dir)); */
     /* dir->inode = openi(f, path, 0); */
@@ -724,25 +1601,45 @@ fs_dir * fs_opendir(fs* f, const char* path) {
     /* dir->f = f; */
     /* dir->cur_off=0; */
     /* return dir; */
-    return opendiri(f, openi(f, path, 0));
+    long t0 = trace_begin(f);
+    lookup lk;
+    fs_dir * ret = NULL;
+    pthread_rwlock_rdlock(&f->nslock);
+    if (resolve(f, path, &lk) != -1)
+        ret = opendiri(f, lk.ino);
+    pthread_rwlock_unlock(&f->nslock);
+    if (ret != NULL)
+        ret->id = __atomic_add_fetch(&f->rec.ndir, 1, __ATOMIC_RELAXED);
+    api_end(f, FS_OP_OPENDIR, t0, ret != NULL ? ret->id : -1, -1, 0, 0, path);
+    return ret;
 }
 
 int fs_nextent(fs_dir* dir, char* buf, size_t buf_len) {
     fs * f = dir->f;
+    long t0 = trace_begin(f);
     dentry ent;
     int len;
-    if (dir->cur_off >= f->inodes[dir->inode].dcnt * sizeof(dentry)) { 
+    pthread_rwlock_rdlock(&f->nslock);
+    if (dir->cur_off >= iget(f, dir->inode)->dcnt * sizeof(dentry)) { 
+        pthread_rwlock_unlock(&f->nslock);
+        api_end(f, FS_OP_NEXTENT, t0, 0, dir->id, buf_len, 0, NULL);
         return 0;
     }
     readi(f, dir->inode, dir->cur_off, &ent, sizeof(ent));
+    pthread_rwlock_unlock(&f->nslock);
     dir->cur_off += sizeof(ent);
     len = strlen(ent.fname);
     if (buf_len - 1 < len) len = buf_len - 1;
     memcpy(buf, ent.fname, len);
     buf[len] = '\0';
+    api_end(f, FS_OP_NEXTENT, t0, 1, dir->id, buf_len, 0, NULL);
     return 1;
 }
 
 void fs_closedir(fs_dir* dir) {
+    fs * f = dir->f;
+    long t0 = trace_begin(f);
+    int id = dir->id;
     free(dir);
+    api_end(f, FS_OP_CLOSEDIR, t0, 0, id, 0, 0, NULL);
 }
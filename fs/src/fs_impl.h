@@ -0,0 +1,501 @@
+#ifndef FS_IMPL_H_INCLUDED_
+#define FS_IMPL_H_INCLUDED_
+
+/*
+ * Definitions shared between the translation units of the fs library.
+ * Nothing in here is part of the public interface.
+ */
+
+#include "../include/fs.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#define MAX_FD 256
+
+#define blocksz 4096
+#define inodect (blocksz/64)
+#define FREE_BLOCK_NUM 500
+#define MAX_PATH_LEN 252
+#define MAX_FNAME_LEN 124
+#define MAX_FILE_SIZE (8*blocksz/sizeof(int)*blocksz)
+#define MAX_EXT_FILE_SIZE 0xffffffffu
+
+#define DCACHE_ENTRIES 4096
+#define DEFAULT_CACHE_SIZE (8 << 20)
+#define MIN_CACHE_BLOCKS 16
+#define META_CACHE_SHARE 4     /* 1/4 of the cache is kept for metadata */
+#define CACHE_SHARDS 16        /* at most; see cache.c */
+#define ILOCKS 64              /* inode locks, shared by inode number */
+#define DIRTY_EXPIRE 30000     /* ms, flusher defaults */
+#define DIRTY_RATIO 10
+#define JOURNAL_BLOCKS 1024
+#define AIO_THREADS 4
+#define RA_MIN_BLOCKS 4        /* readahead window, see fs.c */
+#define RA_MAX_BLOCKS 64
+#define STAT_SLOTS 16          /* counter slots shared out to threads */
+#define TRACE_RINGS 16         /* trace buffers, likewise; see trace.c */
+#define TRACE_EVENTS 8192      /* default events per trace buffer */
+
+/* inode mode bits */
+#define I_DIR 1
+#define I_INDIRECT 2
+#define I_INDEXED 4         /* directory with a hash index, see fs.c */
+#define I_DIRIDX 8          /* the hash index of a directory */
+#define I_EXTENT 16         /* block_id[] holds an extent tree, see extent.c */
+
+/* block classes, see cache.c */
+#define BUF_DATA 0
+#define BUF_META 1
+
+typedef struct superblock_ {
+    char magic_number[4];
+    int block_offset;
+    int inode_cnt;
+    int block_cnt;
+    int total_free_block_num;
+    int free_blocks[FREE_BLOCK_NUM];
+    int free_inode;
+    /* the fields below are valid only if feat_magic == FEAT_MAGIC */
+    int feat_magic;
+    int features;
+    int nblocks;        /* data blocks */
+    int bmap_blocks;    /* bitmap blocks, one per block group; see balloc.c */
+    int alloc_hint;     /* where the next allocation starts looking */
+    int gdt_blocks;     /* blocks of group descriptors */
+    int ipg;            /* inodes per group */
+    int jstart;         /* first data block of the journal, see journal.c */
+    int jlen;
+} superblock;
+
+#define FEAT_MAGIC 0x66656174
+#define FEAT_BITMAP 1
+#define FEAT_GROUPS 2
+#define FEAT_JOURNAL 4
+
+#define BLOCKS_PER_GROUP (blocksz * 8)
+
+/* block group descriptor, see balloc.c */
+typedef struct gdesc_ {
+    int free_blocks;
+    int free_inodes;
+    int dirs;
+    int ihint;          /* where to start looking for a free inode */
+} gdesc;
+
+typedef struct backend_ backend;
+
+typedef struct backend_ops_ {
+    int (*read)(backend*, long blk, void* buf, int nblk);
+    int (*write)(backend*, long blk, const void* buf, int nblk);
+    /* read nblk consecutive blocks into bufs[], one block each */
+    int (*readv)(backend*, long blk, char * const * bufs, int nblk);
+    /* write nblk consecutive blocks taken one each from bufs[] */
+    int (*writev)(backend*, long blk, char * const * bufs, int nblk);
+    int (*flush)(backend*);
+    long (*size)(backend*);
+    void (*close)(backend*);
+} backend_ops;
+
+struct backend_ {
+    const backend_ops * ops;
+    char * base;        /* the image in memory if blocks may be used in place */
+    long len;
+};
+
+/* absolute image block of data block bid */
+#define ABSBLK(f, bid) ((f)->sb.block_offset / blocksz + (long) (bid))
+
+/* the last run of blocks mapped through a descriptor, see fs.c */
+typedef struct mapcur_ {
+    int lblk;
+    int pblk;
+    int len;            /* 0 if empty */
+    unsigned int gen;   /* fs map_gen when filled */
+} mapcur;
+
+typedef struct fdesc_ {
+    int inodeid;
+    int mode;
+    int used;
+    int dir;            /* a directory opened as a file */
+    unsigned int offset;
+    int ra_next;        /* block a sequential read goes on at */
+    int ra_end;         /* first block not yet read ahead */
+    int ra_win;         /* readahead window, 0 after a random read */
+    mapcur map;
+} fdesc;
+
+/*
+ * A cached block. Buffers live on a hash chain keyed by bid and on one
+ * queue of their partition. openblk() returns a buffer pinned, and a
+ * buffer with pin > 0 is never chosen as a victim; brelse() drops the
+ * pin. Ghost entries of the 2Q policy are buffers queued on a1out; they
+ * hold only a block id.
+ */
+typedef struct buffer {
+    int dirty;
+    int age;            /* flusher passes seen while dirty */
+    int ckpt;           /* committed to the journal, home block stale */
+    int pin;
+    int bid;
+    int cls;
+    struct buffer * hnext;
+    struct buffer * prev;
+    struct buffer * next;
+    struct bqueue_ * q;
+    char * d;
+} buffer;
+
+typedef struct bqueue_ {
+    buffer head;        /* head.next is the most recently queued buffer */
+    int len;
+} bqueue;
+
+typedef struct bpart_ {
+    int cap;
+    int size;           /* cap as set up; buffers lent to the other
+                           partition change cap, see reclaim() */
+    int kin;            /* target length of a1in */
+    int kout;           /* number of ghosts kept on a1out */
+    bqueue freeq;
+    bqueue a1in;
+    bqueue am;
+    bqueue a1out;
+    bqueue ghosts;      /* unused ghost entries */
+    unsigned long hits;
+    unsigned long misses;
+} bpart;
+
+/* an independently locked slice of the cache, see cache.c */
+typedef struct bshard_ {
+    pthread_mutex_t lock;
+    int nhash;
+    buffer ** hash;
+    bpart part[2];
+} bshard;
+
+typedef struct bcache_ {
+    int nbuf;
+    int ntotal;
+    int nshard;
+    buffer * bufs;      /* every buffer of every shard */
+    char * data;
+    bshard * shards;
+} bcache;
+
+typedef struct dcentry_ {
+    int parent;         /* -1 if unused */
+    int ino;            /* -1 for a negative entry */
+    int pos;            /* dentry index in parent */
+    unsigned int hash;
+    struct dcentry_ * hnext;
+    struct dcentry_ * prev;
+    struct dcentry_ * next;
+    char name[MAX_FNAME_LEN];
+} dcentry;
+
+typedef struct dcache_ {
+    pthread_mutex_t lock;
+    int n;
+    int nhash;
+    dcentry * ents;
+    dcentry ** hash;
+    dcentry lru;        /* lru.next is the most recently used entry */
+} dcache;
+
+/* background write-back, see flush.c */
+typedef struct flushctl_ {
+    int on;
+    int stop;
+    int interval;       /* ms between passes */
+    int expire;         /* passes a block may stay dirty */
+    int ratio;          /* percent of the cache allowed to be dirty */
+    int passes;
+    pthread_t thread;
+    pthread_mutex_t mu;     /* guards stop */
+    pthread_cond_t cv;
+} flushctl;
+
+/* asynchronous requests, see aio.c */
+typedef struct aioreq_ aioreq;
+
+typedef struct aioctl_ {
+    int nthread;
+    int started;        /* workers running */
+    int stop;
+    int next_id;
+    int pending;        /* submitted and not yet reaped */
+    aioreq * head;      /* waiting for a worker */
+    aioreq * tail;
+    aioreq * done;      /* finished, waiting for fs_poll()/fs_wait() */
+    aioreq * done_tail;
+    pthread_t * threads;
+    pthread_mutex_t mu;
+    pthread_cond_t work;
+    pthread_cond_t ready;
+} aioctl;
+
+typedef struct journal_ {
+    int on;
+    int pos;            /* next free block of the log */
+    int seq;            /* sequence number of the next transaction */
+    superblock sb;      /* as of the last commit */
+    int * frees;        /* bid, n pairs freed since the last checkpoint;
+                           guarded by alock */
+    int nfree;
+    int ncommit;        /* how many of frees[] a commit has made durable */
+    int capfree;
+} journal;
+
+/*
+ * Counters of fs_getstats(), see stats.c. Each thread adds to one of
+ * STAT_SLOTS slots, padded a cache line apart, so that threads busy on
+ * different files do not fight over the counters; cache hits and misses
+ * are kept per shard under the shard lock instead.
+ */
+enum {
+    ST_EVICT,           /* cached blocks reclaimed for other blocks */
+    ST_WRITEBACK,       /* dirty blocks written home */
+    ST_BLK_READ,        /* blocks read from the image */
+    ST_BLK_WRITE,       /* blocks written to the image */
+    ST_READAHEAD,       /* blocks read ahead of use */
+    ST_MAP_LOAD,        /* indirect and extent blocks opened by bmap() */
+    ST_LOOKUP,          /* names looked up in a directory */
+    ST_DCACHE_HIT,      /* ... answered by the dentry cache */
+    ST_DIRENT_SCAN,     /* dentries and index slots examined */
+    ST_BALLOC,
+    ST_BFREE,
+    ST_IALLOC,
+    ST_IFREE,
+    NSTATS
+};
+
+typedef struct statslot_ {
+    unsigned long v[NSTATS];
+    char pad[64 - NSTATS * sizeof(unsigned long) % 64];
+} statslot;
+
+/*
+ * Traced spans, see trace.c: the public calls FS_OP_*, then these.
+ */
+enum {
+    TR_BLK_READ = FS_NOPS,  /* openblk() reading a missed block */
+    TR_READAHEAD,       /* one run read ahead */
+    TR_WRITEBLK,
+    TR_WRITEBACK,       /* one run written back */
+    TR_ALLOC,
+    TR_COMMIT,          /* journal commit */
+    NTRACE
+};
+
+typedef struct tevent_ {
+    long ts;            /* ns on CLOCK_MONOTONIC */
+    long dur;
+    int ev;
+    int tid;
+    long arg;
+} tevent;
+
+/* a ring of events written by the threads dealt to it */
+typedef struct tring_ {
+    tevent * ev;        /* cap events, allocated on first use */
+    unsigned long head; /* events ever put */
+    char pad[64 - sizeof(tevent*) - sizeof(unsigned long)];
+} tring;
+
+/* bits of tracectl.on */
+#define TRACE_ON 1
+#define RECORD_ON 2     /* see record.c */
+
+typedef struct tracectl_ {
+    int on;             /* TRACE_ON | RECORD_ON */
+    int cap;            /* events per ring, a power of two */
+    long base;          /* ns when tracing was first started */
+    tring rings[TRACE_RINGS];
+    pthread_mutex_t mu; /* start, stop and dump */
+} tracectl;
+
+/* the log of fs_record_start(), see record.c */
+typedef struct recorder_ {
+    FILE * fp;          /* NULL unless recording */
+    long base;          /* ns when recording started */
+    int ndir;           /* directories opened, for fs_dir ids */
+    pthread_mutex_t mu;
+} recorder;
+
+/*
+ * Locking. Locks nest in this order:
+ *
+ *   oplock      shared by every call that may change metadata, exclusive
+ *               for sync, fsync, journal commits and flusher passes, so
+ *               those see no operation half done
+ *   nslock      directory contents and the current directory; shared for
+ *               lookups, exclusive for creating and removing names
+ *   ilock[]     contents, size and block map of regular files
+ *   alock       bitmaps, group descriptors and the free counts and lists
+ *   fdlock      the fd table
+ *   dc.lock, bc.shards[].lock -- the latter one at a time, except in
+ *               bcache_lock_all()
+ *   itbl_lock   taken only to read in a block of the inode table
+ *
+ * Readers of a file take only its inode lock and the cache shards their
+ * blocks hash to, so reads of different files proceed in parallel.
+ */
+struct fs_ {
+    pthread_rwlock_t oplock;
+    pthread_rwlock_t nslock;
+    pthread_rwlock_t ilock[ILOCKS];
+    pthread_mutex_t alock;
+    pthread_rwlock_t fdlock;
+    int errno_;
+    superblock sb;
+    inode * inodes;         /* the table; only blocks set in iloaded are valid */
+    unsigned char * iloaded;    /* bitmap of inode-table blocks read in */
+    unsigned char * idirty; /* bitmap of modified inode-table blocks */
+    pthread_mutex_t itbl_lock;  /* serializes reading in table blocks */
+    fdesc fds[MAX_FD];
+    unsigned int map_gen;   /* bumped whenever mapped blocks are freed */
+    backend * be;
+    bcache bc;
+    dcache dc;
+    flushctl fl;
+    aioctl aio;
+    journal jnl;
+    statslot stats[STAT_SLOTS];
+    tracectl trace;
+    recorder rec;
+    char cdir[MAX_PATH_LEN * 2];
+    int dno;
+};
+
+/* backend.c */
+backend * be_open(int kind, const char * fname, long nblk);
+
+/* cache.c */
+int bcache_init(fs * f, size_t cache_size, int mapped);
+void bcache_destroy(fs * f);
+buffer * openblk(fs * f, int bid, int cls);
+buffer * getblk(fs * f, int bid, int cls);
+void brelse(fs * f, buffer * b);
+int writeblk(fs * f, buffer * b);
+int bcache_readahead(fs * f, int bid, int n, int cls);
+void bcache_lock_all(fs * f);
+void bcache_unlock_all(fs * f);
+int bcache_flush(fs * f);
+int bcache_flush_blk(fs * f, int bid);
+int bcache_flush_cls(fs * f, int cls);
+int bcache_writeback(fs * f, int expire, int ratio);
+int bcache_meta_dirty(fs * f, int * total);
+
+/* fs.c */
+int write_super(fs * f);
+void idirty(fs * f, int ino);
+void iload(fs * f, long first, long last);
+
+/*
+ * Inode ino, reading in the blocks of the table that hold it on first
+ * use. Every access to f->inodes goes through here.
+ */
+static inline inode * iget(fs * f, int ino) {
+    long first = sizeof(inode) * (long) ino / blocksz;
+    long last = (sizeof(inode) * (long) (ino + 1) - 1) / blocksz;
+    if (!(__atomic_load_n(&f->iloaded[first / 8], __ATOMIC_ACQUIRE) & (1 << (first % 8))) ||
+        !(__atomic_load_n(&f->iloaded[last / 8], __ATOMIC_ACQUIRE) & (1 << (last % 8))))
+        iload(f, first, last);
+    return &f->inodes[ino];
+}
+
+/* flush.c */
+int flusher_start(fs * f, const fs_opts * opts);
+void flusher_stop(fs * f);
+
+/* aio.c */
+void aio_init(fs * f, const fs_opts * opts);
+void aio_stop(fs * f);
+void aio_destroy(fs * f);
+
+/* balloc.c */
+int alloc_run(fs * f, int goal, int want, int * got);
+int free_run(fs * f, int bid, int n);
+int release_run(fs * f, int bid, int n);
+int alloc_blk(fs * f);
+int free_blk(fs * f, int bid);
+int ino_goal(fs * f, int ino);
+int ialloc(fs * f, int parent, int dir);
+void ifree(fs * f, int ino, int dir);
+int balloc_init(fs * f, int nblk, int ninode);
+
+/* extent.c */
+int ext_map(fs * f, int ip, int bn, int alloc, int * run, int * fresh);
+void ext_release(fs * f, int ip);
+
+/* journal.c */
+int jnl_create(fs * f, int jlen);
+int jnl_recover(fs * f);
+int jnl_commit(fs * f);
+int jnl_want_commit(fs * f);
+int jnl_checkpoint(fs * f);
+int jnl_defer_free(fs * f, int bid, int n);
+int jnl_has_deferred(fs * f);
+int jnl_held(fs * f, int bid, int * n);
+int jnl_close(fs * f);
+
+/* dcache.c */
+unsigned int name_hash(const char * s);
+int dcache_init(fs * f, int n);
+void dcache_destroy(fs * f);
+int dcache_lookup(fs * f, int parent, const char * name, int * ino, int * pos);
+void dcache_enter(fs * f, int parent, const char * name, int ino, int pos);
+void dcache_move(fs * f, int parent, const char * name, int pos);
+void dcache_purge(fs * f, int parent);
+
+/* stats.c */
+extern __thread int thread_no;
+int thread_no_init(void);
+
+/* small number of the calling thread, from 1 on */
+static inline int thread_id(void) {
+    return thread_no > 0 ? thread_no : thread_no_init();
+}
+
+/* add n to counter k of the calling thread's slot */
+static inline void stat_add(fs * f, int k, unsigned long n) {
+    __atomic_add_fetch(&f->stats[thread_id() % STAT_SLOTS].v[k], n,
+                       __ATOMIC_RELAXED);
+}
+
+/* trace.c */
+void trace_init(fs * f);
+void trace_destroy(fs * f);
+long trace_now(void);
+void trace_put(fs * f, int ev, long t0, long arg);
+
+/*
+ * Bracket a span: t0 = trace_begin(f) ... trace_end(f, ev, t0, arg), or
+ * api_end() for a public call, which goes to the trace and to the log
+ * of fs_record_start(). With neither on this costs a load and a branch.
+ */
+static inline long trace_begin(fs * f) {
+    return __atomic_load_n(&f->trace.on, __ATOMIC_ACQUIRE) ? trace_now() : 0;
+}
+
+static inline void trace_end(fs * f, int ev, long t0, long arg) {
+    if (t0 != 0) trace_put(f, ev, t0, arg);
+}
+
+/* record.c */
+void rec_init(fs * f);
+void rec_destroy(fs * f);
+void api_put(fs * f, int op, long t0, int ret, int fd, long arg,
+             unsigned int off, const char * path);
+
+/*
+ * End public call op that started at t0 and returned ret; the other
+ * arguments are what a replay needs to repeat it (see fs_rec).
+ */
+static inline void api_end(fs * f, int op, long t0, int ret, int fd, long arg,
+                           unsigned int off, const char * path) {
+    if (t0 != 0) api_put(f, op, t0, ret, fd, arg, off, path);
+}
+
+#endif
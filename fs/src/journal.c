@@ -0,0 +1,469 @@
+#include "fs_impl.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Metadata journal.
+ *
+ * Images created with FS_OPT_JOURNAL reserve jlen contiguous data blocks
+ * for a write-ahead log. Block 0 of the log is a header holding the
+ * sequence number of the first transaction that still has to be
+ * replayed; transactions follow from block 1 on:
+ *
+ *   jdesc  up to JD_MAX absolute block numbers
+ *   ...    a copy of each of those blocks
+ *   (more jdesc + copies)
+ *   jcommit  sequence number, block count and checksum of the copies
+ *
+ * A commit gathers everything changed since the previous one -- the
+ * superblock, the modified inode-table blocks and every dirty metadata
+ * buffer -- and appends it in one sequential write, so any number of
+ * operations share a single transaction. File data is not logged; it is
+ * written in place before the commit that makes it reachable. Committed
+ * buffers are clean but flagged ckpt: their home block is stale until
+ * the log is checkpointed or the buffer is evicted.
+ *
+ * A checkpoint copies the committed blocks from the log to their home
+ * location, exactly like recovery in fs_openfs, and then empties the log
+ * by advancing the header's sequence number. A freed block is marked
+ * free in its bitmap by the transaction that frees it, so a crash after
+ * the commit does not lose it, but it is held from reuse until the
+ * first checkpoint after that commit: no home block written by the log
+ * can have been reused for file data in the meantime, and a crash can
+ * not leave a block both free on disk and still in use.
+ *
+ * Commits run with f->oplock held exclusively, so no operation is half
+ * done. A checkpoint may also be forced by the allocator in the middle
+ * of an operation; it needs f->alock, which guards the deferred frees.
+ */
+
+#define JNL_MAGIC 0x6a6e6c68
+#define JD_MAGIC 0x6a646573
+#define JC_MAGIC 0x6a636d74
+#define JD_MAX (blocksz / (int) sizeof(int) - 3)
+
+typedef struct jhdr_ {
+    int magic;
+    int seq;
+} jhdr;
+
+typedef struct jdesc_ {
+    int magic;
+    int seq;
+    int n;
+    int tag[JD_MAX];    /* absolute block numbers */
+} jdesc;
+
+typedef struct jcommit_ {
+    int magic;
+    int seq;
+    int n;
+    unsigned int sum;
+} jcommit;
+
+#define JBLK(f, i) ABSBLK(f, (f)->sb.jstart + (i))
+
+static unsigned int jsum(unsigned int sum, const char * d) {
+    const unsigned int * p = (const unsigned int*) d;
+    int i;
+    for (i = 0; i < blocksz / (int) sizeof(int); ++i)
+        sum = sum * 31 + p[i];
+    return sum;
+}
+
+static int write_hdr(fs * f, int seq) {
+    char * blk = calloc(1, blocksz);
+    jhdr * h = (jhdr*) blk;
+    int ret;
+    if (blk == NULL) return 0;
+    h->magic = JNL_MAGIC;
+    h->seq = seq;
+    ret = f->be->ops->write(f->be, JBLK(f, 0), blk, 1);
+    stat_add(f, ST_BLK_WRITE, 1);
+    free(blk);
+    return ret;
+}
+
+/*
+ * Copy every complete transaction in the log to its home blocks. Returns
+ * the sequence number following the last one applied, or -1.
+ */
+static int replay(fs * f) {
+    backend * be = f->be;
+    char * blk = malloc(blocksz);
+    char * data = malloc(blocksz);
+    int * tag = malloc(f->sb.jlen * sizeof(int));
+    int * at = malloc(f->sb.jlen * sizeof(int));
+    int seq = -1, pos = 1;
+
+    if (blk == NULL || data == NULL || tag == NULL || at == NULL ||
+        !be->ops->read(be, JBLK(f, 0), blk, 1) ||
+        ((jhdr*) blk)->magic != JNL_MAGIC)
+        goto out;
+    seq = ((jhdr*) blk)->seq;
+
+    for (;;) {
+        unsigned int sum = 0;
+        int n = 0, i, done = 0;
+
+        while (!done) {
+            jdesc * d = (jdesc*) blk;
+            jcommit * c = (jcommit*) blk;
+            if (pos >= f->sb.jlen || !be->ops->read(be, JBLK(f, pos), blk, 1))
+                goto out;
+            ++pos;
+            if (d->magic == JD_MAGIC && d->seq == seq && d->n > 0 &&
+                d->n <= JD_MAX && pos + d->n <= f->sb.jlen) {
+                for (i = 0; i < d->n; ++i) {
+                    tag[n] = d->tag[i];
+                    at[n++] = pos++;
+                }
+                for (i = n - d->n; i < n; ++i) {
+                    if (!be->ops->read(be, JBLK(f, at[i]), data, 1)) goto out;
+                    sum = jsum(sum, data);
+                }
+            }
+            else if (c->magic == JC_MAGIC && c->seq == seq && c->n == n &&
+                     c->sum == sum)
+                done = 1;
+            else
+                goto out;
+        }
+
+        for (i = 0; i < n; ++i)
+            if (!be->ops->read(be, JBLK(f, at[i]), data, 1) ||
+                !be->ops->write(be, tag[i], data, 1)) {
+                seq = -1;
+                goto out;
+            }
+        ++seq;
+    }
+
+out:
+    free(blk);
+    free(data);
+    free(tag);
+    free(at);
+    return seq;
+}
+
+/*
+ * Write the committed state home and empty the log. Safe in the middle
+ * of an operation: nothing that has not been committed is written. The
+ * caller holds f->alock.
+ */
+int jnl_checkpoint(fs * f) {
+    journal * j = &f->jnl;
+    int seq, i, n;
+
+    if (!j->on) return 1;
+    if ((seq = replay(f)) < 0 || !f->be->ops->flush(f->be) ||
+        !write_hdr(f, seq) || !f->be->ops->flush(f->be))
+        return 0;
+    j->seq = seq;
+    j->pos = 1;
+    bcache_lock_all(f);
+    for (i = 0; i < f->bc.ntotal; ++i)
+        f->bc.bufs[i].ckpt = 0;
+    bcache_unlock_all(f);
+
+    /* now the blocks freed by committed transactions may be reused */
+    n = j->ncommit;
+    for (i = 0; i < n; i += 2)
+        release_run(f, j->frees[i], j->frees[i + 1]);
+    if (n > 0) {
+        memmove(j->frees, j->frees + n, (j->nfree - n) * sizeof(int));
+        j->nfree -= n;
+    }
+    j->ncommit = 0;
+    return 1;
+}
+
+/* remember n blocks from bid to be freed once committed and checkpointed */
+int jnl_defer_free(fs * f, int bid, int n) {
+    journal * j = &f->jnl;
+    if (j->nfree + 2 > j->capfree) {
+        int cap = j->capfree ? j->capfree * 2 : 256;
+        int * p = realloc(j->frees, cap * sizeof(int));
+        if (p == NULL) return 0;
+        j->frees = p;
+        j->capfree = cap;
+    }
+    j->frees[j->nfree++] = bid;
+    j->frees[j->nfree++] = n;
+    return 1;
+}
+
+/*
+ * Is bid held as freed since the last checkpoint? Returns the block
+ * after its run if so; -1 if not, with *n cut so that the n blocks from
+ * bid are clear of all held ones. The caller holds f->alock.
+ */
+int jnl_held(fs * f, int bid, int * n) {
+    journal * j = &f->jnl;
+    int i;
+    for (i = 0; i < j->nfree; i += 2) {
+        int start = j->frees[i], end = start + j->frees[i + 1];
+        if (bid >= start && bid < end) return end;
+        if (start > bid && start - bid < *n) *n = start - bid;
+    }
+    return -1;
+}
+
+/* would a checkpoint now give blocks back? */
+int jnl_has_deferred(fs * f) {
+    return f->jnl.on && f->jnl.ncommit > 0;
+}
+
+static int checkpoint(fs * f) {
+    int ret;
+    pthread_mutex_lock(&f->alock);
+    ret = jnl_checkpoint(f);
+    pthread_mutex_unlock(&f->alock);
+    return ret;
+}
+
+static int count_dirty(fs * f, int cls) {
+    int i, n = 0;
+    bcache_lock_all(f);
+    for (i = 0; i < f->bc.ntotal; ++i)
+        if (f->bc.bufs[i].dirty && f->bc.bufs[i].cls == cls)
+            ++n;
+    bcache_unlock_all(f);
+    return n;
+}
+
+/* log blocks needed by a transaction of n blocks */
+static int tx_blocks(int n) {
+    return (n + JD_MAX - 1) / JD_MAX + n + 1;
+}
+
+/*
+ * Append one transaction of the n blocks bufs[], to be replayed to
+ * tags[], at the current end of the log, which has room for it.
+ */
+static int write_tx(fs * f, int * tags, char ** bufs, int n) {
+    journal * j = &f->jnl;
+    backend * be = f->be;
+    int nd = (n + JD_MAX - 1) / JD_MAX, need = tx_blocks(n);
+    char * ctl = calloc(nd + 1, blocksz);
+    char ** v = malloc(need * sizeof(char*));
+    jcommit * c = (jcommit*) (ctl + (long) nd * blocksz);
+    unsigned int sum = 0;
+    int i, k, t = 0, ret = 0;
+
+    if (ctl == NULL || v == NULL) goto out;
+    /* lay out descriptors, copies and the commit record */
+    for (i = 0; i < n; i += JD_MAX) {
+        jdesc * d = (jdesc*) (ctl + (long) (i / JD_MAX) * blocksz);
+        int m = n - i < JD_MAX ? n - i : JD_MAX;
+        d->magic = JD_MAGIC;
+        d->seq = j->seq;
+        d->n = m;
+        memcpy(d->tag, tags + i, m * sizeof(int));
+        v[t++] = (char*) d;
+        for (k = i; k < i + m; ++k) {
+            sum = jsum(sum, bufs[k]);
+            v[t++] = bufs[k];
+        }
+    }
+    c->magic = JC_MAGIC;
+    c->seq = j->seq;
+    c->n = n;
+    c->sum = sum;
+    v[t++] = (char*) c;
+    ret = be->ops->writev(be, JBLK(f, j->pos), v, t) && be->ops->flush(be);
+    stat_add(f, ST_BLK_WRITE, t);
+    if (ret) {
+        j->pos += need;
+        j->seq++;
+    }
+out:
+    free(ctl);
+    free(v);
+    return ret;
+}
+
+/*
+ * Commit every metadata change made since the previous commit as one
+ * transaction. Called with f->oplock held exclusively.
+ *
+ * jnl_want_commit() keeps a transaction well within the log; one that
+ * does not fit even in an empty log is written as several, each of
+ * them atomic, but not all of them together.
+ */
+static int commit(fs * f) {
+    journal * j = &f->jnl;
+    backend * be = f->be;
+    long nit = (sizeof(inode) * (long) f->sb.inode_cnt + blocksz - 1) / blocksz;
+    int nmeta = 0, n = 0, max, m, i, k;
+    int data_written;
+    char * sbblk = NULL;
+    char ** bufs = NULL;
+    int * tags = NULL;
+    buffer ** logged = NULL;
+    int locked = 0;
+    int ret = 0;
+
+    if (!j->on) return 1;
+
+    /* ordered: file data reaches its blocks before the metadata naming it */
+    data_written = count_dirty(f, BUF_DATA) > 0;
+    if (data_written && (!bcache_flush_cls(f, BUF_DATA) || !be->ops->flush(be)))
+        return 0;
+
+    nmeta = count_dirty(f, BUF_META);
+    for (i = 0; i < nit; ++i)
+        if (f->idirty[i / 8] & (1 << (i % 8)))
+            ++nmeta;
+    if (nmeta == 0 && memcmp(&j->sb, &f->sb, sizeof(f->sb)) == 0)
+        return 1;
+
+    /* the most blocks a transaction in an empty log can hold */
+    max = f->sb.jlen - 2 - (f->sb.jlen - 2 + JD_MAX) / (JD_MAX + 1);
+    n = nmeta + 1;
+    if (j->pos + tx_blocks(n < max ? n : max) > f->sb.jlen && !checkpoint(f))
+        return 0;
+    sbblk = calloc(1, blocksz);
+    bufs = malloc(n * sizeof(char*));
+    tags = malloc(n * sizeof(int));
+    logged = malloc(n * sizeof(buffer*));
+    if (max < 1 || sbblk == NULL || bufs == NULL || tags == NULL ||
+        logged == NULL)
+        goto out;
+
+    /* the blocks of the transaction, in tags[] / bufs[] order */
+    memcpy(sbblk, &f->sb, sizeof(f->sb));
+    k = 0;
+    tags[k] = 0;
+    logged[k] = NULL;
+    bufs[k++] = sbblk;
+    for (i = 0; i < nit; ++i)
+        if (f->idirty[i / 8] & (1 << (i % 8))) {
+            tags[k] = 1 + i;
+            logged[k] = NULL;
+            bufs[k++] = (char*) f->inodes + (long) i * blocksz;
+        }
+    bcache_lock_all(f);
+    locked = 1;
+    for (i = 0; i < f->bc.ntotal && k < n; ++i) {
+        buffer * b = &f->bc.bufs[i];
+        if (b->dirty && b->cls == BUF_META) {
+            tags[k] = ABSBLK(f, b->bid);
+            logged[k] = b;
+            bufs[k++] = b->d;
+        }
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < max ? n - i : max;
+        if (j->pos + tx_blocks(m) > f->sb.jlen) {
+            /* dirty metadata stays put: it can not be evicted */
+            bcache_unlock_all(f);
+            locked = 0;
+            if (!checkpoint(f)) goto out;
+            bcache_lock_all(f);
+            locked = 1;
+        }
+        if (!write_tx(f, tags + i, bufs + i, m)) goto out;
+        for (k = i; k < i + m; ++k)
+            if (logged[k] != NULL) {
+                logged[k]->dirty = 0;
+                logged[k]->age = 0;
+                logged[k]->ckpt = 1;
+            }
+    }
+
+    memcpy(&j->sb, sbblk, sizeof(f->sb));
+    memset(f->idirty, 0, (nit + 7) / 8);
+    bcache_unlock_all(f);
+    locked = 0;
+    pthread_mutex_lock(&f->alock);
+    j->ncommit = j->nfree;
+    pthread_mutex_unlock(&f->alock);
+    /* keep room for the next transaction */
+    ret = j->pos > f->sb.jlen / 2 ? checkpoint(f) : 1;
+
+out:
+    if (locked)
+        bcache_unlock_all(f);
+    free(sbblk);
+    free(bufs);
+    free(tags);
+    free(logged);
+    return ret;
+}
+
+int jnl_commit(fs * f) {
+    long t0;
+    int ret;
+    if (!f->jnl.on) return 1;
+    t0 = trace_begin(f);
+    ret = commit(f);
+    trace_end(f, TR_COMMIT, t0, ret);
+    return ret;
+}
+
+/*
+ * Should the caller commit now? Yes once uncommitted metadata fills
+ * half of a metadata partition, before the partition has to grow, or
+ * would take up half of the log. Called with f->oplock held.
+ */
+int jnl_want_commit(fs * f) {
+    long nit = (sizeof(inode) * (long) f->sb.inode_cnt + blocksz - 1) / blocksz;
+    long i;
+    int n;
+    if (!f->jnl.on) return 0;
+    if (bcache_meta_dirty(f, &n) >= 50) return 1;
+    for (i = 0; i < nit; i += 8)
+        n += __builtin_popcount(__atomic_load_n(&f->idirty[i / 8],
+                                                __ATOMIC_RELAXED));
+    return tx_blocks(n + 1) > (f->sb.jlen - 1) / 2;
+}
+
+/*
+ * Set up the journal of a new image: jlen blocks in one run. The image
+ * as formatted is written home first, since recovery finds the log
+ * through the superblock on disk.
+ */
+int jnl_create(fs * f, int jlen) {
+    int got;
+    int start = alloc_run(f, -1, jlen, &got);
+    if (start < 0) return 0;
+    if (got < 4) {
+        free_run(f, start, got);
+        return 0;
+    }
+    f->sb.features |= FEAT_JOURNAL;
+    f->sb.jstart = start;
+    f->sb.jlen = got;
+    if (!write_hdr(f, 1) || !bcache_flush(f) || !write_super(f) ||
+        !f->be->ops->flush(f->be))
+        return 0;
+    f->jnl.on = 1;
+    f->jnl.seq = 1;
+    f->jnl.pos = 1;
+    return 1;
+}
+
+/* replay the journal of an image being opened; f->sb is re-read after */
+int jnl_recover(fs * f) {
+    int seq = replay(f);
+    if (seq < 0 || !f->be->ops->flush(f->be) || !write_hdr(f, seq) ||
+        !f->be->ops->flush(f->be))
+        return 0;
+    f->jnl.on = 1;
+    f->jnl.seq = seq;
+    f->jnl.pos = 1;
+    return 1;
+}
+
+/* commit, checkpoint and stop journaling; used when closing */
+int jnl_close(fs * f) {
+    int ret = jnl_commit(f) && checkpoint(f);
+    f->jnl.on = 0;
+    free(f->jnl.frees);
+    f->jnl.frees = NULL;
+    f->jnl.nfree = f->jnl.ncommit = f->jnl.capfree = 0;
+    return ret;
+}
@@ -0,0 +1,92 @@
+#include "fs_impl.h"
+#include <limits.h>
+#include <string.h>
+
+/*
+ * Workload recording. Between fs_record_start() and fs_record_stop()
+ * every public call that finishes appends an fs_rec to the log: what
+ * was called with which descriptor, size, offset and path, what it
+ * returned, and when it started and how long it took. Buffer contents
+ * are not kept. Records are written under one lock in the order the
+ * calls finish, so a descriptor is always logged as opened before it
+ * is used; bench/fs_replay.c plays a log back.
+ *
+ * Recording shares its on switch with tracing, see trace_begin().
+ */
+
+void rec_init(fs * f) {
+    memset(&f->rec, 0, sizeof(f->rec));
+    pthread_mutex_init(&f->rec.mu, NULL);
+}
+
+void rec_destroy(fs * f) {
+    fs_record_stop(f);
+    pthread_mutex_destroy(&f->rec.mu);
+}
+
+static void rec_put(fs * f, int op, long t0, long now, int ret, int fd,
+                    long arg, unsigned int off, const char * path) {
+    recorder * r = &f->rec;
+    size_t len = path ? strlen(path) : 0;
+    fs_rec e;
+
+    memset(&e, 0, sizeof(e));
+    e.dur = now - t0 < INT_MAX ? now - t0 : INT_MAX;
+    e.op = op;
+    e.path_len = len < USHRT_MAX ? len : USHRT_MAX;
+    e.tid = thread_id();
+    e.fd = fd;
+    e.arg = arg;
+    e.off = off;
+    e.ret = ret;
+    pthread_mutex_lock(&r->mu);
+    if (r->fp != NULL) {
+        e.start = t0 - r->base;
+        fwrite(&e, sizeof(e), 1, r->fp);
+        if (e.path_len)
+            fwrite(path, 1, e.path_len, r->fp);
+    }
+    pthread_mutex_unlock(&r->mu);
+}
+
+void api_put(fs * f, int op, long t0, int ret, int fd, long arg,
+             unsigned int off, const char * path) {
+    int on = __atomic_load_n(&f->trace.on, __ATOMIC_ACQUIRE);
+    if (on & TRACE_ON)
+        trace_put(f, op, t0, ret);
+    if (on & RECORD_ON)
+        rec_put(f, op, t0, trace_now(), ret, fd, arg, off, path);
+}
+
+/* start logging calls to fname; -1 if it cannot be created or a log is open */
+int fs_record_start(fs * f, const char * fname) {
+    recorder * r = &f->rec;
+    int magic = FS_REC_MAGIC;
+    FILE * fp;
+
+    pthread_mutex_lock(&r->mu);
+    if (r->fp != NULL || (fp = fopen(fname, "wb")) == NULL) {
+        pthread_mutex_unlock(&r->mu);
+        return -1;
+    }
+    if (fwrite(&magic, sizeof(magic), 1, fp) != 1) {
+        fclose(fp);
+        pthread_mutex_unlock(&r->mu);
+        return -1;
+    }
+    r->fp = fp;
+    r->base = trace_now();
+    __atomic_fetch_or(&f->trace.on, RECORD_ON, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&r->mu);
+    return 0;
+}
+
+void fs_record_stop(fs * f) {
+    recorder * r = &f->rec;
+    pthread_mutex_lock(&r->mu);
+    __atomic_fetch_and(&f->trace.on, ~RECORD_ON, __ATOMIC_RELEASE);
+    if (r->fp != NULL)
+        fclose(r->fp);
+    r->fp = NULL;
+    pthread_mutex_unlock(&r->mu);
+}
@@ -0,0 +1,50 @@
+#include "fs_impl.h"
+#include <string.h>
+
+/*
+ * Runtime counters. Threads are numbered the first time they count
+ * something and add to slot thread_no % STAT_SLOTS; with more than
+ * STAT_SLOTS threads some share a slot, which is why the adds are
+ * atomic. fs_getstats() sums the slots
+ * and the per-shard cache counters without stopping anyone, so a total
+ * may be a few counts behind a concurrent operation.
+ */
+
+__thread int thread_no;
+static int last_thread_no;
+
+int thread_no_init(void) {
+    thread_no = __atomic_add_fetch(&last_thread_no, 1, __ATOMIC_RELAXED);
+    return thread_no;
+}
+
+static unsigned long total(fs * f, int k) {
+    unsigned long n = 0;
+    int s;
+    for (s = 0; s < STAT_SLOTS; ++s)
+        n += __atomic_load_n(&f->stats[s].v[k], __ATOMIC_RELAXED);
+    return n;
+}
+
+void fs_getstats(fs * f, fs_stats * st) {
+    fs_cachestats cs;
+    fs_cachestat(f, &cs);
+    memset(st, 0, sizeof(*st));
+    st->meta_hits = cs.meta_hits;
+    st->meta_misses = cs.meta_misses;
+    st->data_hits = cs.data_hits;
+    st->data_misses = cs.data_misses;
+    st->evictions = total(f, ST_EVICT);
+    st->writebacks = total(f, ST_WRITEBACK);
+    st->blk_reads = total(f, ST_BLK_READ);
+    st->blk_writes = total(f, ST_BLK_WRITE);
+    st->readahead = total(f, ST_READAHEAD);
+    st->map_loads = total(f, ST_MAP_LOAD);
+    st->lookups = total(f, ST_LOOKUP);
+    st->dcache_hits = total(f, ST_DCACHE_HIT);
+    st->dirents_scanned = total(f, ST_DIRENT_SCAN);
+    st->block_allocs = total(f, ST_BALLOC);
+    st->block_frees = total(f, ST_BFREE);
+    st->inode_allocs = total(f, ST_IALLOC);
+    st->inode_frees = total(f, ST_IFREE);
+}
@@ -0,0 +1,163 @@
+#define _POSIX_C_SOURCE 200809L     /* clock_gettime */
+#include "fs_impl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Event tracing. While it is on, every public call and the slow paths
+ * of the cache and the allocator record a span -- start, duration and
+ * one number -- in a ring buffer. Threads write to ring thread_no %
+ * TRACE_RINGS, reserving a slot with one atomic add, so a thread only
+ * meets another on its ring if there are more than TRACE_RINGS of them;
+ * when a ring is full its oldest events are overwritten. Events are
+ * stored with relaxed atomic stores so that fs_trace_dump() may run
+ * while they are written, at the price of possibly catching one half
+ * written.
+ *
+ * fs_trace_dump() writes the rings as Chrome trace JSON, which
+ * chrome://tracing and Perfetto open.
+ */
+
+static const struct {
+    const char * name;
+    const char * cat;
+    const char * arg;
+} evinfo[NTRACE] = {
+    [FS_OP_SYNC] = { "fs_sync", "api", "ret" },
+    [FS_OP_FSYNC] = { "fs_fsync", "api", "ret" },
+    [FS_OP_CHDIR] = { "fs_chdir", "api", "ret" },
+    [FS_OP_OPEN] = { "fs_open", "api", "ret" },
+    [FS_OP_CLOSE] = { "fs_close", "api", "ret" },
+    [FS_OP_READ] = { "fs_read", "api", "ret" },
+    [FS_OP_WRITE] = { "fs_write", "api", "ret" },
+    [FS_OP_READV] = { "fs_readv", "api", "ret" },
+    [FS_OP_WRITEV] = { "fs_writev", "api", "ret" },
+    [FS_OP_PREAD] = { "fs_pread", "api", "ret" },
+    [FS_OP_PWRITE] = { "fs_pwrite", "api", "ret" },
+    [FS_OP_SEEK] = { "fs_seek", "api", "ret" },
+    [FS_OP_FSTAT] = { "fs_fstat", "api", "ret" },
+    [FS_OP_REMOVE] = { "fs_remove", "api", "ret" },
+    [FS_OP_MKDIR] = { "fs_mkdir", "api", "ret" },
+    [FS_OP_REMOVEDIR] = { "fs_removedir", "api", "ret" },
+    [FS_OP_OPENDIR] = { "fs_opendir", "api", "ret" },
+    [FS_OP_NEXTENT] = { "fs_nextent", "api", "ret" },
+    [FS_OP_CLOSEDIR] = { "fs_closedir", "api", "ret" },
+    [FS_OP_WAIT] = { "fs_wait", "api", "ret" },
+    [TR_BLK_READ] = { "block read", "io", "blk" },
+    [TR_READAHEAD] = { "readahead", "io", "blocks" },
+    [TR_WRITEBLK] = { "writeblk", "io", "blk" },
+    [TR_WRITEBACK] = { "write-back", "io", "blocks" },
+    [TR_ALLOC] = { "alloc_blk", "alloc", "blk" },
+    [TR_COMMIT] = { "commit", "journal", "ret" },
+};
+
+long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void trace_init(fs * f) {
+    memset(&f->trace, 0, sizeof(f->trace));
+    pthread_mutex_init(&f->trace.mu, NULL);
+}
+
+void trace_destroy(fs * f) {
+    int i;
+    for (i = 0; i < TRACE_RINGS; ++i)
+        free(f->trace.rings[i].ev);
+    pthread_mutex_destroy(&f->trace.mu);
+}
+
+void trace_put(fs * f, int ev, long t0, long arg) {
+    tracectl * t = &f->trace;
+    int tid = thread_id();
+    tring * r = &t->rings[tid % TRACE_RINGS];
+    tevent * v = __atomic_load_n(&r->ev, __ATOMIC_ACQUIRE);
+    tevent * e;
+    unsigned long h;
+    long now = trace_now();
+
+    /* t0 may have been taken for the recorder alone */
+    if (!(__atomic_load_n(&t->on, __ATOMIC_ACQUIRE) & TRACE_ON)) return;
+    if (v == NULL) {
+        tevent * expect = NULL;
+        /* cap is set before tracing is first turned on and never again */
+        v = calloc(t->cap, sizeof(tevent));
+        if (v == NULL) return;
+        if (!__atomic_compare_exchange_n(&r->ev, &expect, v, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(v);
+            v = expect;
+        }
+    }
+    h = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+    e = &v[h & (t->cap - 1)];
+    __atomic_store_n(&e->ts, t0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->dur, now - t0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->ev, ev, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->tid, tid, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg, arg, __ATOMIC_RELAXED);
+}
+
+/*
+ * Start recording, keeping up to nevents (0: TRACE_EVENTS) of each
+ * ring. The size is fixed the first time; later starts carry on with
+ * the buffers as they are.
+ */
+int fs_trace_start(fs * f, int nevents) {
+    tracectl * t = &f->trace;
+    pthread_mutex_lock(&t->mu);
+    if (t->cap == 0) {
+        if (nevents <= 0) nevents = TRACE_EVENTS;
+        for (t->cap = 1; t->cap < nevents; t->cap <<= 1)
+            ;
+        t->base = trace_now();
+    }
+    __atomic_fetch_or(&t->on, TRACE_ON, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&t->mu);
+    return 0;
+}
+
+void fs_trace_stop(fs * f) {
+    pthread_mutex_lock(&f->trace.mu);
+    __atomic_fetch_and(&f->trace.on, ~TRACE_ON, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&f->trace.mu);
+}
+
+/* write what the rings hold to fname as Chrome trace JSON */
+int fs_trace_dump(fs * f, const char * fname) {
+    tracectl * t = &f->trace;
+    FILE * fp = fopen(fname, "w");
+    int i, first = 1;
+
+    if (fp == NULL) return -1;
+    pthread_mutex_lock(&t->mu);
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (i = 0; i < TRACE_RINGS; ++i) {
+        tring * r = &t->rings[i];
+        tevent * v = __atomic_load_n(&r->ev, __ATOMIC_ACQUIRE);
+        unsigned long h, k;
+        if (v == NULL) continue;
+        h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        for (k = h > (unsigned long) t->cap ? h - t->cap : 0; k < h; ++k) {
+            tevent * e = &v[k & (t->cap - 1)];
+            int ev = __atomic_load_n(&e->ev, __ATOMIC_RELAXED);
+            long ts = __atomic_load_n(&e->ts, __ATOMIC_RELAXED);
+            if (ev < 0 || ev >= NTRACE || ts == 0) continue;
+            fprintf(fp, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+                    "\"args\": {\"%s\": %ld}}", first ? "" : ",",
+                    evinfo[ev].name, evinfo[ev].cat, (ts - t->base) / 1e3,
+                    __atomic_load_n(&e->dur, __ATOMIC_RELAXED) / 1e3,
+                    __atomic_load_n(&e->tid, __ATOMIC_RELAXED), evinfo[ev].arg,
+                    __atomic_load_n(&e->arg, __ATOMIC_RELAXED));
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    pthread_mutex_unlock(&t->mu);
+    return fclose(fp) == 0 ? 0 : -1;
+}
@@ -152,13 +152,14 @@ static int sh_stat(const char* pathname, inode *ibuffer)
 
 static int get_new_path(char* newp, const char* src, const char* dst)
 {
-    int len1 = strlen(dst), len2, i;
+    int len1 = strlen(dst), len2 = -1, i;
     memcpy(newp, dst, len1);
 
     for (i=0; src[i]; i++)
         if ( src[i]=='/' )
             len2=i;
     memcpy(newp+len1, src+len2+1, i-len2-1);
+    newp[len1+i-len2-1] = 0;
 
     return len1+i-len2-1;
 }
@@ -195,7 +196,7 @@ void cp(char* params[], int len)
 
     buf = (char*)malloc(1000);
     while ( (len2=fs_read(filesys, fd1, buf, 1000))>0 )
-        fs_write(filesys, fd2, buf, len);
+        fs_write(filesys, fd2, buf, len2);
 
     free(buf);
     fs_close(filesys, fd2);
@@ -226,7 +227,7 @@ void get(char* params[], int len)
 
     char* buf = (char*)malloc(1000);
     while ( (len2=fread(buf, 1, 1000, fp_src))>0 )
-        fs_write(filesys, fd2, buf, len);
+        fs_write(filesys, fd2, buf, len2);
 
     free(buf);
     fs_close(filesys, fd2);
@@ -255,7 +256,7 @@ void put(char* params[], int len)
 
     char* buf = (char*)malloc(1000);
     while ( (len2=fs_read(filesys, fd, buf, 1000))>0 )
-        fwrite(buf, 1, len, fp_dst);
+        fwrite(buf, 1, len2, fp_dst);
 
     free(buf);
     fclose(fp_dst);
@@ -264,9 +265,55 @@ error:
     free(newp);
 }
 
-const char* commands[]={"ls", "cd", "pwd", "mkdir", "rm", "cp", "get", "put", NULL};
+void stats(char* params[], int len)
+{
+    fs_stats st;
+    
+    if ( len!=0 ) { printf("usage: stats\n"); return; }
+
+    fs_getstats(filesys, &st);
+    printf("cache (meta)     %lu hits, %lu misses\n", st.meta_hits, st.meta_misses);
+    printf("cache (data)     %lu hits, %lu misses\n", st.data_hits, st.data_misses);
+    printf("evictions        %lu\n", st.evictions);
+    printf("write-backs      %lu\n", st.writebacks);
+    printf("blocks read      %lu (%lu ahead of use)\n", st.blk_reads, st.readahead);
+    printf("blocks written   %lu\n", st.blk_writes);
+    printf("map block loads  %lu\n", st.map_loads);
+    printf("name lookups     %lu (%lu from the dentry cache)\n", st.lookups, st.dcache_hits);
+    printf("entries scanned  %lu\n", st.dirents_scanned);
+    printf("block alloc/free %lu / %lu\n", st.block_allocs, st.block_frees);
+    printf("inode alloc/free %lu / %lu\n", st.inode_allocs, st.inode_frees);
+}
+
+void trace(char* params[], int len)
+{
+    if ( len==1 && strcmp(params[0], "on")==0 )
+        fs_trace_start(filesys, 0);
+    else if ( len==1 && strcmp(params[0], "off")==0 )
+        fs_trace_stop(filesys);
+    else if ( len==2 && strcmp(params[0], "dump")==0 ) {
+        if ( fs_trace_dump(filesys, params[1])==-1 )
+            printf("cannot write %s\n", params[1]);
+    }
+    else
+        printf("usage: trace on|off|dump file\n");
+}
+
+void record(char* params[], int len)
+{
+    if ( len==2 && strcmp(params[0], "on")==0 ) {
+        if ( fs_record_start(filesys, params[1])==-1 )
+            printf("cannot record to %s\n", params[1]);
+    }
+    else if ( len==1 && strcmp(params[0], "off")==0 )
+        fs_record_stop(filesys);
+    else
+        printf("usage: record on file|off\n");
+}
+
+const char* commands[]={"ls", "cd", "pwd", "mkdir", "rm", "cp", "get", "put", "stats", "trace", "record", NULL};
 typedef void (*function)(char* p[], int l);
-function func[]={ls, cd, pwd, mkdir, rm, cp, get, put};
+function func[]={ls, cd, pwd, mkdir, rm, cp, get, put, stats, trace, record};
 
 fs* create_file_system(int argc, char** argv)
 {
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../fs/include/fs.h"
+
+/*
+ * Crash check of the journal. A child process works on a journaled
+ * image, syncs, carries on without syncing and exits without closing
+ * the image; the parent then opens it, which replays the log, and
+ * checks that everything synced is there. This is done on a freshly
+ * created image and again on the reopened one, with the default log and
+ * with one too small for a single sync, whose transactions get split.
+ * Each round also frees a large file and allocates it again after the
+ * crash, which only fits if the freed blocks came back.
+ *
+ * usage: crash [image]
+ */
+
+#define NFILES 200
+#define BIG (4 << 20)
+
+static const char * image = "/tmp/fs_crash.img";
+static char buf[BIG];
+
+#define CHECK(c) do { if (!(c)) fail(#c, __LINE__); } while (0)
+
+static void fail(const char * what, int line) {
+    fprintf(stderr, "crash: line %d: %s\n", line, what);
+    exit(1);
+}
+
+static int fsize(int i) {
+    return 100 + i * 20;
+}
+
+/* files tag/f0..f(NFILES-1), every third removed again */
+static void put(fs * f, const char * tag) {
+    char n[64];
+    int i, fd;
+    memset(buf, tag[0], fsize(NFILES));
+    sprintf(n, "/%s", tag);
+    CHECK(fs_mkdir(f, n) == 1);
+    for (i = 0; i < NFILES; ++i) {
+        sprintf(n, "/%s/f%d", tag, i);
+        CHECK((fd = fs_open(f, n, FS_WRITE)) >= 0);
+        CHECK(fs_write(f, fd, buf, fsize(i)) == fsize(i));
+        fs_close(f, fd);
+    }
+    for (i = 0; i < NFILES; i += 3) {
+        sprintf(n, "/%s/f%d", tag, i);
+        CHECK(fs_remove(f, n) == 0);
+    }
+}
+
+static void check(fs * f, const char * tag) {
+    char n[64];
+    int i, fd;
+    for (i = 0; i < NFILES; ++i) {
+        sprintf(n, "/%s/f%d", tag, i);
+        fd = fs_open(f, n, FS_READ);
+        if (i % 3 == 0) {
+            CHECK(fd < 0);
+            continue;
+        }
+        CHECK(fd >= 0);
+        CHECK(fs_read(f, fd, buf, BIG) == fsize(i));
+        CHECK(buf[0] == tag[0] && buf[fsize(i) - 1] == tag[0]);
+        fs_close(f, fd);
+    }
+}
+
+/* write the big file; 0 if the image has no room for it */
+static int put_big(fs * f) {
+    int fd = fs_open(f, "/big", FS_WRITE), ret;
+    CHECK(fd >= 0);
+    memset(buf, 'B', BIG);
+    ret = fs_write(f, fd, buf, BIG) == BIG;
+    fs_close(f, fd);
+    return ret;
+}
+
+static void crash(int fresh, const char * tag, const char * lost, int jlen) {
+    pid_t p = fork();
+    int st;
+    CHECK(p >= 0);
+    if (p == 0) {
+        fs_opts o;
+        fs * f;
+        memset(&o, 0, sizeof(o));
+        o.flags = FS_OPT_JOURNAL;
+        o.journal_blocks = jlen;
+        /* twice the big file would not fit */
+        f = fresh ? fs_creatfs_opt(image, BIG / 4096 * 3 / 2 + 600 +
+                                   (jlen ? jlen : 1024), 1024, &o)
+                  : fs_openfs(image);
+        CHECK(f != NULL);
+        CHECK(put_big(f));
+        put(f, tag);
+        CHECK(fs_remove(f, "/big") == 0);
+        CHECK(fs_sync(f) == 0);
+        put(f, lost);
+        _exit(0);
+    }
+    CHECK(waitpid(p, &st, 0) == p && WIFEXITED(st) && WEXITSTATUS(st) == 0);
+}
+
+int main(int argc, char ** argv) {
+    int jlen[2] = { 0, 16 }, k;
+    fs * f;
+
+    if (argc > 1) image = argv[1];
+    for (k = 0; k < 2; ++k) {
+        crash(1, "a", "x", jlen[k]);
+        CHECK((f = fs_openfs(image)) != NULL);
+        check(f, "a");
+        fs_closefs(f);
+
+        crash(0, "b", "y", jlen[k]);
+        CHECK((f = fs_openfs(image)) != NULL);
+        check(f, "a");
+        check(f, "b");
+        CHECK(put_big(f));
+        fs_closefs(f);
+    }
+    unlink(image);
+    printf("crash: ok\n");
+    return 0;
+}